@@ -33,6 +33,8 @@
 #include <unistd.h>  /* usleep(), ... */
 #include <string.h>  /* strcmp(), ... */
 #include <signal.h>  /* signals */
+#include <time.h>    /* time(), ctime(), clock_gettime() */
+#include <pthread.h> /* list mode writer thread */
 
 #include <sys/stat.h> /* mkdir(), ...*/
 
@@ -52,16 +54,26 @@ void print_usage() {
   /* Argument desc.: */
   printf("\t -d n\tOperate on device with device_no n (see -l)\n");
   printf("\t -t\tSample for time T, then exit (-1=infinite)\n");
-  printf("\t -i\tSampling interval T\n\t\t(pha-mode: default 1s, list-mode: default 50ms)\n\t\tvalid time suffix's are one of: ms,s,m,h,d,y (omitted s is assumed)\n");
+  printf("\t -i\tSampling interval T\n\t\t(pha-mode: default 1s, list-mode: initially 50ms, then adapted to the rate)\n\t\tvalid time suffix's are one of: us,ms,s,m,h,d,y (omitted s is assumed)\n");
   printf("\t -s\tPrint status every n:th measurement (default off)\n");
 /*JK, not tested  printf("\t -lm\tSet in list mode, print c=counts,a=amplitudes,t=times\n");*/
 /*JK, not working  printf("\t -diff\tPrint differential spectra rather than cumulative\n");*/
+  printf("\t -amp low high\tList mode: only amplitudes low-high (can be repeated)\n");
+  printf("\t -gate T0 T1\tList mode: only events between T0 and T1 after the first\n\t\tlist mode time stamp, at most ~1 s after start (can be repeated)\n");
+  printf("\t -slice T\tSpectra per time slice T, histogrammed from list mode events\n");
+  printf("\t -dt\tList mode: print dead time/pile-up estimate from the inter-arrival times\n");
+  printf("\t -mcs T\tMultichannel scaling, print counts per dwell time T (1us-1s, e.g. 100us, from\n\t\tlist mode time stamps, independent of the sampling interval),\n\t\tlines are: bin start in device time (us), counts\n");
   printf("\t -cps\tPrint cps instead of spectra\n");
+  printf("\t -win T\tPrint the spectrum of the last T (sliding window) instead of the cumulative one\n");
   printf("\t -q\tQuiet\n");
   printf("\t -h\tPrints this message\n");
   printf("\t -l\tList connected digibase's device_no, serial_no and dev_names\n");
   printf("\t -b\tBinary output (default ASCII)\n");
+  printf("\t -sparse\tBinary spectra as sparse frames when mostly zero (see libdbase_read_spectrum_frame())\n");
   printf("\t -o\tOutput to file (default is stdout)\n");
+  printf("\t -store FILE\tAlso append each spectrum (and status) to spectrum store FILE\n");
+  printf("\t -peaks\tPrint the tracked peaks (id, centroid, FWHM, net area, its std dev) after each spectrum\n");
+  printf("\t -acc FILE\tAdd the run's spectrum to the 64-bit totals in FILE (created if missing)\n");
 
   /* CTRL commands  */
   printf(" CTRL: \n");
@@ -121,6 +133,8 @@ void print_usage() {
 detector *det = NULL;
 /* output file handle */
 FILE *fh = NULL;
+/* List mode filter (-amp/-gate), NULL if not used */
+lm_filter *lmf = NULL;
 /* verbose output */
 int q = 0;
 
@@ -157,6 +171,19 @@ int main(int argc, char **argv) {
   /* List mode arguments */
   int lm=0;
   char lmc=0,lmt=0,lma=0;
+  unsigned long long g0=0ULL, g1=0ULL;
+  /* MCS dwell time, spectrum slice (us) */
+  unsigned long long dwell=0ULL, slice=0ULL;
+  /* Print dead time estimate after list mode */
+  int dtm=0;
+  /* Sliding window (us), 0 = off */
+  unsigned long long wint=0ULL;
+  /* Spectrum store file, or NULL */
+  char *sfile=NULL;
+  /* Accumulator file, or NULL */
+  char *afile=NULL;
+  /* Track peaks */
+  int peaks=0;
   /* output file, hv settings etc. */
   char *ofile=NULL, *hv=NULL, *gs=NULL, *zs=NULL, *dev_name=NULL;
   /* Settings parameters */
@@ -185,7 +212,7 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -s\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	s = atol(argv[k+1]);
 	k++;
@@ -195,13 +222,13 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -hv\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	hv = argv[k+1];
 	if(strcmp(hv,"on") != 0 && strcmp(hv,"off") != 0){
 	  if(!q)
 	    fprintf(stderr, "E: hv parameter must be 'on' or 'off'\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	k++;
       }
@@ -210,13 +237,13 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -zs\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	zs = argv[k+1];
 	if(strcmp(zs,"on") != 0 && strcmp(zs,"off") != 0){
 	  if(!q)
 	    fprintf(stderr, "E: zs parameter must be 'on' or 'off'\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	k++;
       }
@@ -225,13 +252,13 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -gs\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	gs = argv[k+1];
 	if(strcmp(hv,"on") != 0 && strcmp(gs,"off") != 0){
 	  if(!q)
 	    fprintf(stderr, "E: gs parameter must be 'on' or 'off'\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	k++;
       }
@@ -240,7 +267,7 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -i\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	parse_time(&sleept, argv[k+1]);
 	k++;
@@ -250,7 +277,7 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -lm\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	lm = 1;
 	/* Can be one or several of: c,a,t */
@@ -260,7 +287,50 @@ int main(int argc, char **argv) {
 	if(lmc == 0 && lmt == 0 && lma == 0){
 	  if(!q)
 	    fprintf(stderr, "E: list mode arguments must be one or more of 'c,a,t'\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
+	}
+	k++;
+      }
+    /* Multichannel scaling, dwell time */
+    else if(strcmp(argv[k],"-mcs") == 0)
+      {
+	if(argc < k+2){
+	  fprintf(stderr, "E: lacking argument to -mcs\n");
+	  return dbase_fail();
+	}
+	parse_time(&dwell, argv[k+1]);
+	if(dwell == 0ULL || dwell > 1000000ULL){
+	  fprintf(stderr, "E: -mcs dwell time must be 1us-1s\n");
+	  return dbase_fail();
+	}
+	k++;
+      }
+    /* Sliding window spectra */
+    else if(strcmp(argv[k],"-win") == 0)
+      {
+	if(argc < k+2){
+	  fprintf(stderr, "E: lacking argument to -win\n");
+	  return dbase_fail();
+	}
+	parse_time(&wint, argv[k+1]);
+	k++;
+      }
+    /* Dead time estimate */
+    else if(strcmp(argv[k],"-dt") == 0)
+      {
+	dtm = 1;
+      }
+    /* Time-sliced spectra */
+    else if(strcmp(argv[k],"-slice") == 0)
+      {
+	if(argc < k+2){
+	  fprintf(stderr, "E: lacking argument to -slice\n");
+	  return dbase_fail();
+	}
+	parse_time(&slice, argv[k+1]);
+	if(slice == 0ULL){
+	  fprintf(stderr, "E: -slice time must be positive\n");
+	  return dbase_fail();
 	}
 	k++;
       }
@@ -269,7 +339,7 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -t\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	parse_time(&t, argv[k+1]);
 	k++;
@@ -279,7 +349,7 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -name\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	name = 1;
 	dev_name = argv[k+1];
@@ -302,6 +372,12 @@ int main(int argc, char **argv) {
 	/* since it's binary output assume quiet */
 	q = 1;
       }
+    /* Print binary spectra as sparse/dense frames */
+    else if(strcmp(argv[k],"-sparse") == 0)
+      {
+	b = 2;
+	q = 1;
+      }
     /* Start measurement */
     else if(strcmp(argv[k],"-start") == 0)
       {
@@ -322,7 +398,7 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -d\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	dev = atoi(argv[k+1]);
 	k++;
@@ -346,12 +422,40 @@ int main(int argc, char **argv) {
 		  stderr, 
 		  "E: lacking arguments for -roi, must give low and high channels\n"
 		  );
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	roi_lc = atoi(argv[k+1]);
 	roi_hc = atoi(argv[k+2]);
 	k+=2;
       }
+    /* List mode amplitude range */
+    else if(strcmp(argv[k],"-amp") == 0)
+      {
+	if(argc < k+3){
+	  fprintf(stderr, "E: lacking arguments for -amp, must give low and high amplitude\n");
+	  return dbase_fail();
+	}
+	if(lmf == NULL && (lmf = libdbase_lm_filter_new()) == NULL)
+	  return dbase_fail();
+	if(libdbase_lm_filter_amp(lmf, atoi(argv[k+1]), atoi(argv[k+2])) < 0)
+	  return dbase_fail();
+	k+=2;
+      }
+    /* List mode time window */
+    else if(strcmp(argv[k],"-gate") == 0)
+      {
+	if(argc < k+3){
+	  fprintf(stderr, "E: lacking arguments for -gate, must give start and end times\n");
+	  return dbase_fail();
+	}
+	if(lmf == NULL && (lmf = libdbase_lm_filter_new()) == NULL)
+	  return dbase_fail();
+	parse_time(&g0, argv[k+1]);
+	parse_time(&g1, argv[k+2]);
+	if(g1 > 0x7fffffffULL || libdbase_lm_filter_window(lmf, (uint32_t) g0, (uint32_t) g1) < 0)
+	  return dbase_fail();
+	k+=2;
+      }
     /* Print cps */
     else if(strcmp(argv[k],"-cps") == 0)
       {
@@ -361,21 +465,44 @@ int main(int argc, char **argv) {
     else if(strcmp(argv[k],"-o") == 0){
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -o\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
       ofile = argv[k+1];
       k++;
     }
+    /* Append spectra to a spectrum store */
+    else if(strcmp(argv[k],"-store") == 0){
+	if(argc < k+2){
+	  fprintf(stderr, "E: lacking argument to -store\n");
+	  return dbase_fail();
+	}
+      sfile = argv[k+1];
+      k++;
+    }
+    /* Peak tracking */
+    else if(strcmp(argv[k],"-peaks") == 0)
+      {
+	peaks = 1;
+      }
+    /* Accumulate spectra across runs */
+    else if(strcmp(argv[k],"-acc") == 0){
+	if(argc < k+2){
+	  fprintf(stderr, "E: lacking argument to -acc\n");
+	  return dbase_fail();
+	}
+      afile = argv[k+1];
+      k++;
+    }
     /* Clear commands */
     else if(strcmp(argv[k],"-clr") == 0)
       {
 	if(argc < k+2){
 	  fprintf(stderr, "E: lacking argument to -clr\n MUST be one of all/spec/pres/cnt\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	if(parse_settings(argv[k+1], argv, &opts, k+2, argc, &k) < 0){
 	  fprintf(stderr, "E: -clr arguments given but no value\nMust give one of all/spec/pres/cnt\n");
-	return EXIT_FAILURE;
+	return dbase_fail();
 	}
 	/* flag that options have changed */
 	opts.haveopts = 1;
@@ -385,11 +512,11 @@ int main(int argc, char **argv) {
       {
 	if(argc < k+3){
 	  fprintf(stderr, "E: lacking arguement(s) to -set \n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 	}
 	if( parse_settings(argv[k+1], argv, &opts, k+2, argc, &k) < 0 ){
 	  fprintf(stderr, "E: -set argument given but no value\n");
-	  return EXIT_FAILURE;
+	  return dbase_fail();
 }
 	/* flag that options have changed */
 	opts.haveopts = 1;
@@ -408,7 +535,7 @@ int main(int argc, char **argv) {
     else if(!q)
       {
 	printf("Error: unknown command: %s\n", argv[k]);
-	return EXIT_FAILURE;
+	return dbase_fail();
       }
   }
 
@@ -420,7 +547,7 @@ int main(int argc, char **argv) {
     {
       if(!q)
 	printf("No valid commands given - aborting\n");
-      return EXIT_FAILURE;
+      return dbase_fail();
     }
 
   /* Allow up to 32 dbases */
@@ -435,7 +562,7 @@ int main(int argc, char **argv) {
     if(found < 0){
       if(!q)
 	fprintf(stderr, "E: couldn't find serial numbers\n");
-      return EXIT_FAILURE;
+      return dbase_fail();
     }
   }
 
@@ -443,7 +570,7 @@ int main(int argc, char **argv) {
   if(list){
     if(found < 1){
       printf("Did not find any digibase on usb bus\n");
-      return EXIT_FAILURE;
+      return dbase_fail();
     }
     char path[PATH_MAX_LEN], dname[128];
     libdbase_get_path(dir, sizeof(dir));
@@ -485,7 +612,7 @@ int main(int argc, char **argv) {
     if(det == NULL){
       if(!q)
 	fprintf(stderr, "Error: Couldn't open device no %d\n", dev);
-      return EXIT_FAILURE;
+      return dbase_fail();
     }
   }
   else{
@@ -494,7 +621,7 @@ int main(int argc, char **argv) {
     if((det = libdbase_init(-1, str)) == NULL){
       if(!q)
 	fprintf(stderr, "Error: Couldn't open digibase\n");
-      return EXIT_FAILURE;
+      return dbase_fail();
     }
   }
 
@@ -679,12 +806,16 @@ int main(int argc, char **argv) {
       if(d == 0){
 	if(b == 0)
 	  libdbase_print_file_spectrum(det, fh == NULL ? stdout : fh);
+	else if(b == 2)
+	  libdbase_print_file_spectrum_sparse(det, fh == NULL ? stdout : fh);
 	else
 	  libdbase_print_file_spectrum_binary(det, fh == NULL ? stdout : fh);
 	}
       else {
 	if(b == 0)
 	  libdbase_print_diff_file_spectrum(det, fh == NULL ? stdout : fh);
+	else if(b == 2)
+	  libdbase_print_diff_file_spectrum_sparse(det, fh == NULL ? stdout : fh);
 	else
 	  libdbase_print_diff_file_spectrum_binary(det, fh == NULL ? stdout : fh);
       }
@@ -706,15 +837,51 @@ int main(int argc, char **argv) {
 
   /* Collect data and print spectrum */
   int err = 1;
+  /* Inter-arrival times/dead time of the list mode readouts */
+  lm_iat *lmi = NULL;
+  if(dtm == 1 && (lm == 1 || dwell > 0ULL || slice > 0ULL)){
+    if((lmi = libdbase_lm_iat_new(LM_IAT_TAIL)) != NULL)
+      libdbase_set_lm_iat(det, lmi);
+  }
   /* List Mode measurement */
   if(lm == 1 && sleept <= 1000000UL && sleept > 0UL && t > 0UL){
     /* Change default 1s to 50ms */
     if(sleept == 1000000UL)
       sleept = 50000UL;
+    /* stdout may be the binary output */
     if(!q)
-      printf("Starting List Mode measurement freq: %llu Hz", 1000000ULL/sleept);
+      fprintf(b == 0 ? stdout : stderr, 
+	      "Starting List Mode measurement freq: %llu Hz", 1000000ULL/sleept);
     /* Start list mode measurement */
-    measure_list_mode(lmc, lma, lmt, t, sleept);
+    libdbase_set_lm_filter(det, lmf);
+    /* -sparse is binary list mode output */
+    measure_list_mode(lmc, lma, lmt, (char) (b != 0), t, sleept);
+    if(lmf != NULL){
+      uint64_t passed, rejected;
+      libdbase_lm_filter_stats(lmf, &passed, &rejected);
+      if(!q)
+	fprintf(stderr, "List mode filter: %llu events passed, %llu rejected\n",
+		(unsigned long long) passed, (unsigned long long) rejected);
+      libdbase_set_lm_filter(det, NULL);
+    }
+  }
+  /* Multichannel scaling */
+  else if(dwell > 0ULL && t > 0UL){
+    if(!q)
+      printf("Starting MCS measurement, dwell time: %llu us\n", dwell);
+    measure_mcs(dwell, t);
+  }
+  /* Time-sliced spectra */
+  else if(slice > 0ULL && t > 0UL){
+    if(!q)
+      printf("Starting sliced spectra measurement, slice: %llu us\n", slice);
+    measure_slices(slice, (char) b, t);
+  }
+  if(lmi != NULL){
+    libdbase_set_lm_iat(det, NULL);
+    libdbase_get_status(det);
+    libdbase_print_lm_deadtime(lmi, det, stderr);
+    libdbase_lm_iat_free(lmi);
   }
 
   /*JK, time stamp*/
@@ -722,31 +889,60 @@ int main(int argc, char **argv) {
 
   unsigned long long i;
   /* PHA Mode measurement, max freq 20Hz */
-  if(lm == 0 && t > 0UL && sleept > 50000UL){
+  if(lm == 0 && dwell == 0ULL && slice == 0ULL && t > 0UL && sleept > 50000UL){
+    /* Long-run totals, attached before the clear so the whole run counts */
+    spec_accum *acc = NULL;
+    if(afile != NULL){
+      acc = access(afile, F_OK) == 0 ? libdbase_accum_load(afile) : libdbase_accum_new();
+      if(acc == NULL)
+	fprintf(stderr, "E: couldn't load accumulator %s\n", afile);
+      libdbase_set_accum(det, acc);
+    }
     /* Clear counters and spectrum */
     libdbase_clear_all(det);
     /* Number of measurement cycles */
     unsigned long long cycles = (unsigned long long) (t / sleept);
     uint last_sum = 0, sum;
+    /* Sliding window over the diff spectra */
+    spec_window *win = NULL;
+    if(wint > 0ULL){
+      win = libdbase_window_new((int) ((wint + sleept - 1) / sleept), wint);
+      libdbase_set_window(det, win);
+    }
+    /* Peak tracker */
+    spec_peaks *pks = NULL;
+    if(peaks){
+      pks = libdbase_peaks_new(5.0, 4, 0.1);
+      libdbase_set_peaks(det, pks);
+    }
+    /* Spectrum store */
+    spec_store *sto = NULL;
+    if(sfile != NULL && (sto = libdbase_store_open(sfile, 1)) == NULL)
+      fprintf(stderr, "E: couldn't open spectrum store %s\n", sfile);
     for(i=0; i < cycles; i++){
       if(!q)
 	printf("Msmt (%llu/%llu): Sleeping %llu ms\n", i+1, cycles, (sleept/1000UL));
 
-      /*JK print start time (on the screen)*/
+      /*JK print start time (on the screen), not into binary output */
       timestamp = time(0); /*JK*/ 
-      fprintf(fh == NULL ? stdout : fh, /*JK*/ 
-              "\nStart (dbaserh): %s", ctime(&timestamp)); /*JK*/ 
-      fprintf(fh == NULL ? stdout : fh, /*JK*/ 
-              "Counting Time (dbaserh):  %llu.%02llu s\n",
-              (sleept/1000000UL), (sleept%1000000UL)); /*JK*/ 
+      if(b == 0){
+        fprintf(fh == NULL ? stdout : fh, /*JK*/ 
+                "\nStart (dbaserh): %s", ctime(&timestamp)); /*JK*/ 
+        fprintf(fh == NULL ? stdout : fh, /*JK*/ 
+                "Counting Time (dbaserh):  %llu.%02llu s\n",
+                (sleept/1000000UL), (sleept%1000000UL)); /*JK*/ 
+      }
 
       usleep(sleept);
 
       if( (err = libdbase_get_spectrum(det)) >= 0)
 	{
          timestamp = time(0); /*JK*/ 
-         fprintf(fh == NULL ? stdout : fh, /*JK*/ 
-                "End (dbaserh):   %s\n", ctime(&timestamp)); /*JK*/
+         if(b == 0)
+           fprintf(fh == NULL ? stdout : fh, /*JK*/ 
+                   "End (dbaserh):   %s\n", ctime(&timestamp)); /*JK*/
+	  if(sto != NULL && libdbase_store_append(sto, det) < 0)
+	    fprintf(stderr, "E: couldn't append to spectrum store\n");
  
 	  if(cps == 1){
 	    /* Just print counts per second */
@@ -756,10 +952,27 @@ int main(int argc, char **argv) {
 		    "%s%0.00f\n", q ? "" : "CPS: ", cps);
 	    last_sum = sum;
 	  }
+	  else if(win != NULL){
+	    /* print window spectrum */
+	    int32_t ws[DBASE_LEN+1];
+	    char wbuf[12 * (DBASE_LEN+1) + 1];
+	    int wn;
+	    libdbase_window_get(win, ws, NULL, NULL);
+	    if(b == 0 && (wn = libdbase_format_spectrum(ws, det->status.LEN+1, wbuf, sizeof(wbuf))) > 0)
+	      fwrite(wbuf, 1, wn, fh == NULL ? stdout : fh);
+	    else if(b == 2){
+	      unsigned char fb[DBASE_FRAME_MAX];
+	      fwrite(fb, 1, libdbase_encode_spectrum(ws, fb), fh == NULL ? stdout : fh);
+	    }
+	    else if(b != 0)
+	      fwrite(ws, sizeof(int32_t), DBASE_LEN+1, fh == NULL ? stdout : fh);
+	  }
 	  else if(d == 0){
 	    /* print cumulative spectrum */
 	    if(b == 0)
 	      libdbase_print_file_spectrum(det, fh == NULL ? stdout : fh);
+	    else if(b == 2)
+	      libdbase_print_file_spectrum_sparse(det, fh == NULL ? stdout : fh);
 	    else
 	      libdbase_print_file_spectrum_binary(det, fh == NULL ? stdout : fh);
 	  }
@@ -767,19 +980,27 @@ int main(int argc, char **argv) {
 	    /* print differential spectrum */
 	    if(b == 0)
 	      libdbase_print_diff_file_spectrum(det, fh == NULL ? stdout : fh);
+	    else if(b == 2)
+	      libdbase_print_diff_file_spectrum_sparse(det, fh == NULL ? stdout : fh);
 	    else
 	      libdbase_print_diff_file_spectrum_binary(det, fh == NULL ? stdout : fh);
 	  }
+	  /* Tracked peaks */
+	  if(pks != NULL && b == 0){
+	    peak_info pi[PEAK_MAX];
+	    int np = libdbase_peaks_get(pks, pi, PEAK_MAX), m;
+	    for(m = 0; m < np; m++)
+	      fprintf(fh == NULL ? stdout : fh, "Peak %d: %.2f %.2f %.0f %.0f\n",
+		      pi[m].id, pi[m].centroid, pi[m].fwhm, pi[m].net, pi[m].err);
+	  }
 	  /* Status interval - print status */
 	  if(s > 0UL && (i+1) % s == 0){
 	    err = libdbase_get_status(det);
 	    if(err >= 0){
 	      if(b == 0)
 		libdbase_print_file_status(&det->status, det->serial, fh == NULL ? stdout : fh);
-	      else {
+	      else if(b != 2) /* -sparse: frames only, see libdbase_read_spectrum_frame() */
 		fwrite(&det->status, sizeof(status_msg), 1, fh == NULL ? stdout : fh);
-		fflush(fh == NULL ? stdout : fh);
-	      }
 	    }
 	    else if(!q){
 	      fprintf(stderr, 
@@ -787,12 +1008,28 @@ int main(int argc, char **argv) {
 	      break;
 	    }
 	  }
+	  /* One flush per readout */
+	  fflush(fh == NULL ? stdout : fh);
 	}
       else if(!q){
 	fprintf(stderr, "E: couldn't read spectrum (err=%d) - exiting\n", err);
 	break;
       }
     }
+    libdbase_set_window(det, NULL);
+    libdbase_window_free(win);
+    libdbase_store_close(sto);
+    libdbase_set_peaks(det, NULL);
+    libdbase_peaks_free(pks);
+    if(acc != NULL){
+      libdbase_set_accum(det, NULL);
+      if(!q)
+	printf("Accumulated counts: %llu\n", 
+	       (unsigned long long) libdbase_accum_get(acc, NULL, NULL));
+      if(libdbase_accum_save(acc, afile) < 0)
+	fprintf(stderr, "E: couldn't save accumulator %s\n", afile);
+      libdbase_accum_free(acc);
+    }
   }
 
   /* Stat command given */
@@ -817,26 +1054,44 @@ int main(int argc, char **argv) {
   if(fh != NULL)
     fclose(fh);
   /* Close and free memory */
+  libdbase_lm_filter_free(lmf);
   libdbase_close(det);
   return EXIT_SUCCESS;
 }
 
 /*
   This function handles measurements in list-mode
+
+  The poll interval adapts to the event rate: at high rates the
+  device is read often (and with a larger buffer) so its FIFO
+  stays below LM_FIFO_HWM, at low rates it is read seldom.
+  sleept is the initial interval and, when counts are printed,
+  also the interval between printed counts.
+  With lmb set, all pulses are written as a binary list-mode
+  archive (see libdbase_lm_archive_open_write()) instead.
+
+  Pulses are handed to a writer thread (see lm_writer_start())
+  so that slow output never delays the readouts.
 */
-void measure_list_mode(char lmc, char lma, char lmt, 
+void measure_list_mode(char lmc, char lma, char lmt, char lmb, 
 		       unsigned long long lm_time, 
 		       unsigned long long sleept){
   if(det == NULL) 
     return;
 
-  /* Calc time per session (read/sleep cycle) */
-  unsigned long long k, e = (lm_time / sleept);
-
   /* buffer size (max nbr of event per readout) */
-  int len = 2048;
-  int read, n;
+  int len = LM_MIN_BUF;
+  int read, counts = 0, count;
   uint32_t time=0;
+  /* Words transferred by a readout */
+  uint64_t words;
+  /* FIFO fill rate estimate (words/us) */
+  double rate = 0.0;
+  /* Times (us) */
+  unsigned long long start, now, last, out, nap = sleept;
+  /* Longest interval, counts are printed every sleept */
+  unsigned long long max_sleep = lmc == 1 ? sleept : LM_MAX_SLEEP;
+  FILE *o = fh == NULL ? stdout : fh;
 
   /* Set in list mode */
   if(libdbase_set_list_mode(det) < 0)
@@ -846,64 +1101,95 @@ void measure_list_mode(char lmc, char lma, char lmt,
   libdbase_start(det);
 
   /* 
-     Grab a chunk of memory (max nbr of events is len) 
+     Pulses go to the writer thread, *data is the next free
+     writer buffer (LM_FIFO_WORDS pulses).
      - *data can be null, in which case only the number
        of events are returned
   */
   pulse *data = NULL;
-  if(lma == 1 || lmt == 1){
-    data = calloc(len, sizeof(pulse));
-    if(data == NULL){
+  lm_writer w;
+  int writer = (lma == 1 || lmt == 1 || lmb == 1);
+  if(writer){
+    if(lm_writer_start(&w, o, lma, lmt, lmb) < 0){
       fprintf(stderr, 
-	      "dbase E: couln't allocate memory for listmode pulses\n");
+	      "dbase E: couln't start listmode writer\n");
       return;
     }
   }
 
+  /* No text in the archive */
   if(!q){
-    fprintf(fh == NULL ? stdout : fh, 
-	    "Reading %llu events in list mode, sleeptime is %llu ms\n", 
-	    e, sleept/1000ULL);
+    fprintf(lmb == 1 ? stderr : o, 
+	    "Reading list mode for %llu s, initial sleeptime is %llu ms\n", 
+	    lm_time/1000000ULL, sleept/1000ULL);
   }
-  /* Read e sessions, sleep between readouts */
-  for(k=0; k < e; k++)
+  start = last = out = get_time_us();
+  /* Read until lm_time has passed, sleep between readouts */
+  for(now = start; now - start < lm_time; )
     {
       /* sleep (collect pulses) */
-      usleep(sleept);
+      if(nap > 0ULL)
+	usleep(nap);
+
+      /* Next free buffer, waits only if the writer is far behind */
+      if(writer && (data = lm_writer_buffer(&w)) == NULL){
+	fprintf(stderr, "dbase E: listmode writer failed - stopping\n");
+	break;
+      }
     
-      /* Read pulses */
-      libdbase_read_lm_packets(det, data, len, &read, &time);
+      /* Read pulses, words counts the time words too */
+      words = det->lm.words;
+      if(libdbase_read_lm_packets(det, data, len, &read, &time) < 0)
+	read = 0;
+      words = det->lm.words - words;
+      now = get_time_us();
+
+      /* 
+	 Update rate estimate, smooth over a few readouts. Words 
+	 fill the FIFO, filtered out or not, so pace on them.
+      */
+      if(now > last){
+	if(rate > 0.0)
+	  rate = 0.5 * rate + 0.5 * words / (double)(now - last);
+	else
+	  rate = words / (double)(now - last);
+      }
+      last = now;
       
-      /* output result */
-      if(lmc == 1)
-	/* counts */
-	fprintf(fh == NULL ? stdout : fh, "%d\n", read);
-      if(data != NULL)
-	{
-	  if(lma == 1 && lmt == 1)
-	    for(n=0; n < read; n++)
-	      /* amp and time */
-	      fprintf(fh == NULL ? stdout : fh, 
-		      "%u\t%u\n", data[n].amp, data[n].time);
-	  else if(lma == 1)
-	    for(n=0; n < read; n++)
-	      /* amp */
-	      fprintf(fh == NULL ? stdout : fh, 
-		      "%u\n", data[n].amp);
-	  else
-	    for(n=0; n < read; n++)
-	      /* time */
-	      fprintf(fh == NULL ? stdout : fh, 
-		      "%u\n", data[n].time);
+      /* 
+	 output counts, once per sleept. With pulses, the writer
+	 prints the count after the pulses it counts.
+      */
+      count = -1;
+      if(lmc == 1 && lmb == 0){
+	counts += read;
+	if(now - out >= sleept){
+	  count = counts;
+	  counts = 0;
+	  out = now;
 	}
-      
-      /* Clear data before next readout */
-      if(data != NULL)
-	memset((char*)data, 0, read * sizeof(pulse));
+      }
+
+      /* Hand pulses over to the writer */
+      if(writer)
+	lm_writer_push(&w, read, time, count);
+      else if(count >= 0)
+	fprintf(o, "%d\n", count);
+
+      /* Next interval, and maybe a larger buffer */
+      nap = lm_next_sleep(rate, (int) words, &len, max_sleep);
+      /* FIFO (nearly) overflowed, drain it right away */
+      if(IS_LM_NEAR_OVERFLOW(det) || IS_LM_OVERFLOW(det))
+	nap = 0ULL;
     }
-  /* Free memory */
-  if(data != NULL)
-    free(data);
+
+  /* Drain the writer, write last archive block and index */
+  if(writer)
+    lm_writer_stop(&w);
+
+  /* Readout statistics, always reported if events were lost */
+  if(!q || det->lm.lost > 0ULL || det->lm.usb_overflows > 0ULL)
+    libdbase_print_lm_stats(det, stderr);
 
   /* Stop */
   libdbase_stop(det);
@@ -912,11 +1198,427 @@ void measure_list_mode(char lmc, char lma, char lmt,
   libdbase_set_pha_mode(det);
 }
 
+/*
+  Multichannel scaling (MCS)
+
+  Runs in list mode, but only the time words are used:
+  the events are binned by device time (see libdbase_lm_mcs_feed())
+  and one count per dwell time is printed. The polling adapts to
+  the rate as in measure_list_mode(), and does not limit the
+  resolution. No pulses are decoded.
+*/
+void measure_mcs(unsigned long long dwell, unsigned long long mcs_time){
+  if(det == NULL) 
+    return;
+
+  int len = LM_MIN_BUF, read, n, k;
+  uint64_t nw;
+  double rate = 0.0;
+  unsigned long long start, now, last, nap = LM_MIN_SLEEP;
+  FILE *o = fh == NULL ? stdout : fh;
+  uint64_t first;
+  /* Enough bins for the longest interval between readouts */
+  int nbins = (int) (4ULL * LM_MAX_SLEEP / dwell) + 16;
+  uint32_t *words = (uint32_t*) malloc(LM_FIFO_WORDS * sizeof(uint32_t));
+  uint32_t *counts = (uint32_t*) malloc(nbins * sizeof(uint32_t));
+  lm_mcs *mcs = libdbase_lm_mcs_new((uint32_t) dwell, nbins);
+  if(words == NULL || counts == NULL || mcs == NULL){
+    fprintf(stderr, "dbase E: couln't allocate MCS buffers\n");
+    goto out;
+  }
+
+  /* Set in list mode */
+  if(libdbase_set_list_mode(det) < 0)
+    goto out;
+  libdbase_start(det);
+
+  start = last = get_time_us();
+  for(now = start; now - start < mcs_time; )
+    {
+      if(nap > 0ULL)
+	usleep(nap);
+
+      /* Read and bin */
+      nw = det->lm.words;
+      if((read = libdbase_read_lm_mcs(det, mcs, words, len)) < 0)
+	read = 0;
+      nw = det->lm.words - nw;
+      now = get_time_us();
+      /* Completed bins */
+      while((n = libdbase_lm_mcs_get(mcs, counts, nbins, &first)) > 0)
+	for(k=0; k < n; k++)
+	  fprintf(o, "%llu %u\n", 
+		  (unsigned long long) ((first + k) * dwell), counts[k]);
+
+      /* Update rate estimate */
+      if(now > last){
+	if(rate > 0.0)
+	  rate = 0.5 * rate + 0.5 * nw / (double)(now - last);
+	else
+	  rate = nw / (double)(now - last);
+      }
+      last = now;
+
+      nap = lm_next_sleep(rate, (int) nw, &len, LM_MAX_SLEEP);
+      if(IS_LM_NEAR_OVERFLOW(det) || IS_LM_OVERFLOW(det))
+	nap = 0ULL;
+    }
+
+  /* Last (partial) bin */
+  libdbase_lm_mcs_finish(mcs);
+  while((n = libdbase_lm_mcs_get(mcs, counts, nbins, &first)) > 0)
+    for(k=0; k < n; k++)
+      fprintf(o, "%llu %u\n", 
+	      (unsigned long long) ((first + k) * dwell), counts[k]);
+  fflush(o);
+
+  if(!q || det->lm.lost > 0ULL || det->lm.usb_overflows > 0ULL)
+    libdbase_print_lm_stats(det, stderr);
+
+  libdbase_stop(det);
+  libdbase_set_pha_mode(det);
+ out:
+  libdbase_lm_mcs_free(mcs);
+  free(counts);
+  free(words);
+}
+
+/*
+  Time-sliced spectra
+
+  Runs in list mode and histograms the events into one spectrum
+  per slice (see libdbase_lm_spectra_feed()), printed as soon as
+  the slice is complete. Polling as in measure_mcs().
+*/
+void measure_slices(unsigned long long slice, char bin, 
+		    unsigned long long sl_time){
+  if(det == NULL) 
+    return;
+
+  int len = LM_MIN_BUF, read;
+  uint64_t nw;
+  double rate = 0.0;
+  unsigned long long start, now, last, nap = LM_MIN_SLEEP;
+  FILE *o = fh == NULL ? stdout : fh;
+  uint64_t first;
+  int32_t spec[DBASE_LEN+1];
+  uint32_t *words = (uint32_t*) malloc(LM_FIFO_WORDS * sizeof(uint32_t));
+  lm_spectra *s = libdbase_lm_spectra_new(slice);
+  if(words == NULL || s == NULL){
+    fprintf(stderr, "dbase E: couln't allocate slice buffers\n");
+    goto out;
+  }
+
+  if(libdbase_set_list_mode(det) < 0)
+    goto out;
+  libdbase_start(det);
+
+  start = last = get_time_us();
+  for(now = start; now - start < sl_time; )
+    {
+      if(nap > 0ULL)
+	usleep(nap);
+
+      nw = det->lm.words;
+      if((read = libdbase_read_lm_spectra(det, s, words, len)) < 0)
+	read = 0;
+      nw = det->lm.words - nw;
+      now = get_time_us();
+      while(libdbase_lm_spectra_get(s, spec, &first) > 0)
+	libdbase_print_lm_spectrum(spec, first, o, bin);
+      fflush(o);
+
+      if(now > last){
+	if(rate > 0.0)
+	  rate = 0.5 * rate + 0.5 * nw / (double)(now - last);
+	else
+	  rate = nw / (double)(now - last);
+      }
+      last = now;
+
+      nap = lm_next_sleep(rate, (int) nw, &len, LM_MAX_SLEEP);
+      if(IS_LM_NEAR_OVERFLOW(det) || IS_LM_OVERFLOW(det))
+	nap = 0ULL;
+    }
+
+  /* Last (partial) slice */
+  libdbase_lm_spectra_finish(s);
+  while(libdbase_lm_spectra_get(s, spec, &first) > 0)
+    libdbase_print_lm_spectrum(spec, first, o, bin);
+  fflush(o);
+
+  if(!q || det->lm.lost > 0ULL || det->lm.usb_overflows > 0ULL)
+    libdbase_print_lm_stats(det, stderr);
+
+  libdbase_stop(det);
+  libdbase_set_pha_mode(det);
+ out:
+  libdbase_lm_spectra_free(s);
+  free(words);
+}
+
+/*
+  List mode writer thread.
+
+  The acquisition loop fills the buffers of a bounded queue
+  (LM_QUEUE_LEN batches), the writer thread formats/encodes
+  them and writes them in large chunks (see lm_writer_main()).
+*/
+int lm_writer_start(lm_writer *w, FILE *o, char lma, char lmt, char lmb){
+  int k;
+  memset(w, 0, sizeof(lm_writer));
+  w->out = o;
+  w->lma = lma;
+  w->lmt = lmt;
+  /* Pick the formatter once, not per pulse */
+  w->format = (lma == 1 && lmt == 1) ? lm_format_at :
+    (lma == 1 ? lm_format_a : lm_format_t);
+  if(lmb != 1 && (w->txt = (char *) malloc(LM_TXT_BUF)) == NULL){
+    fprintf(stderr, "dbase E: couln't allocate memory for listmode output\n");
+    return -ENOMEM;
+  }
+  for(k = 0; k < LM_QUEUE_LEN; k++){
+    w->data[k] = (pulse *) malloc(LM_FIFO_WORDS * sizeof(pulse));
+    if(w->data[k] == NULL){
+      fprintf(stderr, "dbase E: couln't allocate memory for listmode pulses\n");
+      lm_writer_free(w);
+      return -ENOMEM;
+    }
+  }
+  if(lmb == 1){
+    w->ar = libdbase_lm_archive_open_write(o, det->serial);
+    if(w->ar == NULL){
+      lm_writer_free(w);
+      return -1;
+    }
+  }
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if(pthread_create(&w->thread, NULL, lm_writer_main, w) != 0){
+    fprintf(stderr, "dbase E: couldn't create listmode writer thread\n");
+    if(w->ar != NULL)
+      libdbase_lm_archive_close(w->ar);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    lm_writer_free(w);
+    return -1;
+  }
+  return 0;
+}
+
+/* Free writer buffers */
+void lm_writer_free(lm_writer *w){
+  int k;
+  free(w->txt);
+  w->txt = NULL;
+  for(k = 0; k < LM_QUEUE_LEN; k++){
+    free(w->data[k]);
+    w->data[k] = NULL;
+  }
+}
+
+/*
+  Next buffer to read pulses into,
+  blocks while the queue is full
+*/
+pulse *lm_writer_buffer(lm_writer *w){
+  pulse *b;
+  pthread_mutex_lock(&w->lock);
+  if(w->count == LM_QUEUE_LEN)
+    w->stalls++;
+  while(w->count == LM_QUEUE_LEN && !w->err)
+    pthread_cond_wait(&w->cond, &w->lock);
+  b = w->err ? NULL : w->data[(w->head + w->count) % LM_QUEUE_LEN];
+  pthread_mutex_unlock(&w->lock);
+  return b;
+}
+
+/* 
+   Queue the buffer from lm_writer_buffer(), holding n pulses,
+   time is the last time word of the readout and count (if >= 0)
+   is printed after the pulses
+*/
+void lm_writer_push(lm_writer *w, int n, uint32_t time, int count){
+  pthread_mutex_lock(&w->lock);
+  w->n[(w->head + w->count) % LM_QUEUE_LEN] = n;
+  w->ts[(w->head + w->count) % LM_QUEUE_LEN] = time;
+  w->cnt[(w->head + w->count) % LM_QUEUE_LEN] = count;
+  w->count++;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* 
+   Write queued batches until stopped and drained.
+   ASCII output collects in w->txt and is written once
+   LM_WRITE_BUF bytes are pending, in large writes without
+   resizing the stream's own buffer.
+*/
+void *lm_writer_main(void *arg){
+  lm_writer *w = (lm_writer *) arg;
+  pulse *b = NULL;
+  char *p;
+  int n = 0, cnt = -1, err = 0, done = 0;
+  uint32_t ts = 0;
+  size_t used = 0;
+  while(!done && !err){
+    pthread_mutex_lock(&w->lock);
+    while(w->count == 0 && !w->done)
+      pthread_cond_wait(&w->cond, &w->lock);
+    done = (w->count == 0);
+    if(!done){
+      b = w->data[w->head];
+      n = w->n[w->head];
+      ts = w->ts[w->head];
+      cnt = w->cnt[w->head];
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    /* Output, the slot stays queued until it is written */
+    if(!done && w->ar != NULL){
+      /* Time word too, rollovers without events */
+      err = (libdbase_lm_archive_write(w->ar, b, n) < 0 ||
+	     libdbase_lm_archive_time(w->ar, ts) < 0);
+    }
+    else if(!done){
+      /* Whole batch is formatted, then its count line */
+      if(n > 0)
+	used += w->format(w->txt + used, b, n);
+      if(cnt >= 0){
+	p = lm_utoa(w->txt + used, (uint32_t) cnt);
+	*p++ = '\n';
+	used = (size_t) (p - w->txt);
+      }
+    }
+    /* Write pending text when enough, or at the end */
+    if(!err && used > 0 && (done || used >= LM_WRITE_BUF)){
+      if(fwrite(w->txt, 1, used, w->out) != used){
+	fprintf(stderr, "dbase E: writing listmode output failed\n");
+	err = 1;
+      }
+      used = 0;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if(err){
+      w->err = 1;
+      pthread_cond_signal(&w->cond);
+    }
+    else if(!done){
+      w->head = (w->head + 1) % LM_QUEUE_LEN;
+      w->count--;
+      pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+  }
+  return NULL;
+}
+
+/*
+  ASCII output.
+  stdio parses the format string and locks the stream for every
+  fprintf(), so the pulses are formatted by hand into one buffer.
+  LM_FORMAT generates one loop per set of fields, without any
+  test of the fields inside the loop.
+*/
+char *lm_utoa(char *p, uint32_t v){
+  char t[10];
+  int n = 0;
+  do {
+    t[n++] = (char) ('0' + v % 10);
+    v /= 10;
+  } while(v > 0);
+  while(n > 0)
+    *p++ = t[--n];
+  return p;
+}
+
+#define LM_FORMAT(name, ...)					\
+  size_t name(char *buf, const pulse *b, int n){		\
+    char *p = buf;						\
+    int k;							\
+    for(k = 0; k < n; k++){					\
+      __VA_ARGS__						\
+      *p++ = '\n';						\
+    }								\
+    return (size_t) (p - buf);					\
+  }
+
+LM_FORMAT(lm_format_at, p = lm_utoa(p, b[k].amp); *p++ = '\t'; p = lm_utoa(p, b[k].time);)
+LM_FORMAT(lm_format_a, p = lm_utoa(p, b[k].amp);)
+LM_FORMAT(lm_format_t, p = lm_utoa(p, b[k].time);)
+
+/* Drain queue, stop thread and close archive */
+void lm_writer_stop(lm_writer *w){
+  pthread_mutex_lock(&w->lock);
+  w->done = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+
+  if(w->ar != NULL)
+    libdbase_lm_archive_close(w->ar);
+  fflush(w->out);
+  if(w->stalls > 0ULL)
+    fprintf(stderr, "dbase W: listmode output was too slow, readout waited %llu times\n",
+	    w->stalls);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  lm_writer_free(w);
+}
+
+/*
+  List mode poll interval:
+  - a full readout (words == *len, time words included) means the
+    FIFO may hold more, so the buffer is doubled and the next
+    read is immediate
+  - otherwise sleep until the buffer is expected to be
+    1/LM_TARGET_FILL full, but never so long that the 
+    FIFO passes its high-water mark
+*/
+unsigned long long lm_next_sleep(double rate, int words, int *len, 
+				 unsigned long long max_sleep){
+  unsigned long long nap, hwm;
+
+  /* Drain immediately */
+  if(words >= *len){
+    if(*len < LM_FIFO_WORDS)
+      *len = (*len * 2 > LM_FIFO_WORDS) ? LM_FIFO_WORDS : *len * 2;
+    return 0ULL;
+  }
+  /* 
+     Shrink again when the rate has dropped so far that even
+     the shortest interval would fill less than a fraction of it
+  */
+  if(*len > LM_MIN_BUF && rate * LM_MIN_SLEEP < *len / (4 * LM_TARGET_FILL))
+    *len /= 2;
+
+  if(rate <= 0.0)
+    return max_sleep;
+
+  nap = (unsigned long long) (*len / LM_TARGET_FILL / rate);
+  hwm = (unsigned long long) (LM_FIFO_HWM / rate);
+  if(nap > hwm)
+    nap = hwm;
+  if(nap > max_sleep)
+    nap = max_sleep;
+  if(nap < LM_MIN_SLEEP)
+    nap = LM_MIN_SLEEP;
+  return nap;
+}
+
+/* Monotonic clock in us */
+unsigned long long get_time_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
 /* Parse a simple time string */
 void parse_time(unsigned long long *duration, const char *input){
   unsigned long long t = 0LL;
   /*  
-      valid time suffix's are ONE of: s,m,h,d,y (omitted s is assumed)\n");
+      valid time suffix's are ONE of: us,ms,s,m,h,d,y (omitted s is assumed)\n");
   */
   if(strstr(input, "y") != NULL)
     t = 1000000ULL*3600ULL*24ULL*365ULL;  /* assume no leap year.. =/ */
@@ -926,6 +1628,8 @@ void parse_time(unsigned long long *duration, const char *input){
     t = 1000000ULL*3600ULL;
   else if(strstr(input, "ms") != NULL)
     t = 1000ULL;
+  else if(strstr(input, "us") != NULL)
+    t = 1ULL;
   else if(strstr(input, "m") != NULL)
     t = 1000000ULL*60ULL;
   else
@@ -1033,12 +1737,19 @@ int parse_settings(const char* set, char** val,
 
 /* Make a clean exit, 
    closing all file handles and the detector */
+int dbase_fail(void){
+  libdbase_lm_filter_free(lmf);
+  lmf = NULL;
+  return EXIT_FAILURE;
+}
+
 void dbase_exit(int ecode){
   if(det != NULL){
     if(!q)
       printf("Closing detector...\n");
     libdbase_close(det);
   }
+  libdbase_lm_filter_free(lmf);
   if(fh != NULL){
     if(!q)
       printf("Closing output file...\n");
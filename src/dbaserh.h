@@ -26,6 +26,55 @@
 
 #define PATH_MAX_LEN 256
 
+/*
+  List mode polling cadence.
+  The readout interval and buffer size adapt to the
+  measured event rate, within these bounds (and the
+  device FIFO size, LM_FIFO_WORDS).
+*/
+#define LM_MIN_BUF      2048       /* initial (min) nbr of pulses per readout */
+#define LM_TARGET_FILL  4          /* aim at 1/4 of the buffer per readout */
+#define LM_MIN_SLEEP    1000ULL    /* shortest poll interval (us) */
+#define LM_MAX_SLEEP    1000000ULL /* longest poll interval (us) */
+#define LM_IAT_TAIL     20ULL      /* dead time estimate: tail of intervals (us) */
+
+/*
+  List mode writer thread:
+  batches of pulses queued between readout and output
+*/
+#define LM_QUEUE_LEN    16         /* max queued readouts */
+#define LM_WRITE_BUF    (1 << 20)  /* ASCII output written in chunks of (bytes) */
+#define LM_TXT_PULSE    22         /* max ASCII bytes per pulse ("amp\ttime\n") */
+#define LM_TXT_COUNT    12         /* max ASCII bytes per count line */
+/* ASCII buffer: pending output plus one formatted batch */
+#define LM_TXT_BUF      (LM_WRITE_BUF + LM_FIFO_WORDS * LM_TXT_PULSE + LM_TXT_COUNT)
+
+/* 
+   ASCII formatter of n pulses into buf (LM_TXT_PULSE bytes per
+   pulse), returns number of bytes. One variant per set of fields.
+*/
+typedef size_t (*lm_format_fn)(char *buf, const pulse *b, int n);
+
+typedef struct {
+  pulse *data[LM_QUEUE_LEN];  /* batch buffers (LM_FIFO_WORDS pulses) */
+  int n[LM_QUEUE_LEN];        /* pulses in each batch */
+  uint32_t ts[LM_QUEUE_LEN];  /* last time word of each batch */
+  int cnt[LM_QUEUE_LEN];      /* count line after each batch, or -1 */
+  int head;                   /* oldest queued batch */
+  int count;                  /* queued batches */
+  int done;                   /* no more batches */
+  int err;                    /* writer failed */
+  unsigned long long stalls;  /* readouts that waited for the writer */
+  char lma, lmt;              /* ASCII fields */
+  lm_format_fn format;        /* ASCII formatter for lma/lmt */
+  char *txt;                  /* ASCII buffer (LM_TXT_BUF bytes) */
+  lm_archive *ar;             /* binary output (-b) */
+  FILE *out;                  /* output stream */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+} lm_writer;
+
 /* 
    Struct holding various user settings
    -set 
@@ -52,13 +101,56 @@ typedef struct{
 /* Signal handler */
 void handle_signal(int sig);
 
-/* Measure in list mode */
+/* Measure in list mode (lmb: write binary list-mode archive) */
 void measure_list_mode(char lmc, 
 		       char lma, 
 		       char lmt, 
+		       char lmb, 
 		       unsigned long long lm_time, 
 		       unsigned long long sleept);
 
+/* Multichannel scaling, print counts per dwell (us) */
+void measure_mcs(unsigned long long dwell, 
+		 unsigned long long mcs_time);
+
+/* Time-sliced spectra, one per slice (us) */
+void measure_slices(unsigned long long slice, 
+		    char bin,
+		    unsigned long long sl_time);
+
+/* Decimal digits of v to p, returns end */
+char *lm_utoa(char *p, uint32_t v);
+
+/* ASCII formatters: amp and time, amp, time */
+size_t lm_format_at(char *buf, const pulse *b, int n);
+size_t lm_format_a(char *buf, const pulse *b, int n);
+size_t lm_format_t(char *buf, const pulse *b, int n);
+
+/* 
+   Next list mode poll interval (us) from the FIFO fill rate (words/us).
+   *len is the readout size (words), it is grown when the last
+   readout transferred all *len words.
+*/
+unsigned long long lm_next_sleep(double rate, 
+				 int words, 
+				 int *len, 
+				 unsigned long long max_sleep);
+
+/* List mode writer thread */
+int lm_writer_start(lm_writer *w, 
+		    FILE *o, 
+		    char lma, 
+		    char lmt, 
+		    char lmb);
+pulse *lm_writer_buffer(lm_writer *w);
+void lm_writer_push(lm_writer *w, int n, uint32_t time, int count);
+void lm_writer_stop(lm_writer *w);
+void lm_writer_free(lm_writer *w);
+void *lm_writer_main(void *arg);
+
+/* Monotonic clock (us) */
+unsigned long long get_time_us();
+
 /* Parse time argument */
 void parse_time(unsigned long long *duration, 
 		const char *input);
@@ -87,3 +179,5 @@ void init_settings(settings* opts);
   Make a clean exit
 */
 void dbase_exit(int ecode);
+/* Free the option buffers (before the detector is open), returns EXIT_FAILURE */
+int dbase_fail(void);
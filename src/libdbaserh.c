@@ -191,6 +191,19 @@ detector* libdbase_init(int dbase_serial, const char *filename){
     return NULL;
   }
 
+  /* No list mode readouts yet */
+  memset(&det->lm, 0, sizeof(lm_stats));
+  det->lmf = NULL;
+  det->lmi = NULL;
+  det->snap = NULL;
+  det->rois = NULL;
+  det->win = NULL;
+  det->pyr = NULL;
+  det->acc = NULL;
+  det->cal = NULL;
+  det->peaks = NULL;
+  det->spec_cleared = 0;
+
   /* Initialize spec and last_spec to zeros */
   for( err = 0; err < DBASE_LEN + 1; err++){
     det->spec[err] = 0;
@@ -653,7 +666,30 @@ int libdbase_get_spectrum(detector *det){
     fprintf(stderr, "E: libdbase_get_spectrum(), det is NULL pointer\n");
     return -1;
   }
-  return dbase_get_spectrum(det->dev, det->spec, det->last_spec);
+  int err = dbase_get_spectrum(det->dev, det->spec, det->last_spec);
+  uint64_t now = 0;
+  /* Counts since the clear */
+  if(err >= 0 && det->spec_cleared){
+    memcpy(det->last_spec, det->spec, sizeof(det->last_spec));
+    det->spec_cleared = 0;
+  }
+  if(err >= 0 && (det->win != NULL || det->pyr != NULL))
+    now = libdbase_host_time_us();
+  if(err >= 0 && det->snap != NULL)
+    dbase_snap_publish(det);
+  if(err >= 0 && det->rois != NULL)
+    libdbase_roi_update(det->rois, det->spec);
+  if(err >= 0 && det->win != NULL)
+    libdbase_window_push(det->win, det->last_spec, now);
+  if(err >= 0 && det->pyr != NULL)
+    libdbase_pyramid_push(det->pyr, det->last_spec, now);
+  if(err >= 0 && det->acc != NULL)
+    libdbase_accum_feed(det->acc, det->spec);
+  if(err >= 0 && det->cal != NULL)
+    libdbase_calib_rebin(det->cal, det->spec, det->cal->out);
+  if(err >= 0 && det->peaks != NULL)
+    libdbase_peaks_update(det->peaks, det->spec, det->last_spec);
+  return err;
 }
 
 /*
@@ -664,7 +700,20 @@ int libdbase_clear_spectrum(detector *det){
     fprintf(stderr, "E: libdbase_clear_spectrum(), det is NULL pointer\n");
     return -1;
   }
-  return dbase_send_clear_spectrum(det->dev);
+  int err = dbase_send_clear_spectrum(det->dev);
+  /* 
+     The device spectrum is zero now, so must ours be, and the
+     next diff is the whole next spectrum (not a large negative 
+     difference, nor the zero diff of a first readout).
+  */
+  if(err >= 0){
+    memset(det->spec, 0, sizeof(det->spec));
+    memset(det->last_spec, 0, sizeof(det->last_spec));
+    det->spec_cleared = 1;
+    if(det->acc != NULL)
+      dbase_accum_cleared(det->acc);
+  }
+  return err;
 }
 
 /*
@@ -685,6 +734,28 @@ void libdbase_print_diff_spectrum(const detector *det){
   dbase_print_spectrum_file(det->last_spec, det->status.LEN+1, stdout);
 }
 
+/*
+  Format spectrum as ASCII into a caller buffer
+*/
+int libdbase_format_spectrum(const int32_t *spec, int len, char *buf, int size){
+  if(spec == NULL || buf == NULL || len <= 0){
+    fprintf(stderr, "E: libdbase_format_spectrum(), invalid spectrum or buffer\n");
+    return -1;
+  }
+  /* Exact size, unless the worst case fits */
+  if(size < DBASE_SPEC_CHARS(len)){
+    int k, need = 1;
+    char tmp[12];
+    for(k = 0; k < len; k++)
+      need += (int) (dbase_itoa(tmp, spec[k]) - tmp) + 1;
+    if(size < need){
+      fprintf(stderr, "E: libdbase_format_spectrum(), buffer too small (%d < %d)\n", size, need);
+      return -1;
+    }
+  }
+  return dbase_format_spectrum(spec, len, buf);
+}
+
 /*
   Print spectrum to FILE (wrapper)
 */
@@ -721,6 +792,68 @@ void libdbase_print_diff_file_spectrum_binary(const detector *det, FILE *fh){
   dbase_print_file_spectrum_binary(det->last_spec, DBASE_LEN + 1, fh);
 }
 
+/*
+  Print spectrum frames to FILE
+*/
+void libdbase_print_file_spectrum_sparse(const detector *det, FILE *fh){
+  if( check_detector(det, "libdbase_print_file_spectrum_sparse") < 0)
+    return;
+  dbase_print_spectrum_frame(det->spec, DBASE_LEN + 1, fh);
+}
+
+void libdbase_print_diff_file_spectrum_sparse(const detector *det, FILE *fh){
+  if( check_detector(det, "libdbase_print_diff_file_spectrum_sparse") < 0)
+    return;
+  dbase_print_spectrum_frame(det->last_spec, DBASE_LEN + 1, fh);
+}
+
+int libdbase_encode_spectrum(const int32_t *spec, unsigned char *buf){
+  if(spec == NULL || buf == NULL){
+    fprintf(stderr, "E: libdbase_encode_spectrum(), spec or buf was NULL\n");
+    return -1;
+  }
+  return dbase_encode_spectrum(spec, DBASE_LEN + 1, buf);
+}
+
+int libdbase_decode_spectrum(const unsigned char *buf, int n, int32_t *spec){
+  if(spec == NULL || buf == NULL){
+    fprintf(stderr, "E: libdbase_decode_spectrum(), buf or spec was NULL\n");
+    return -1;
+  }
+  return dbase_decode_spectrum(buf, n, spec, DBASE_LEN + 1);
+}
+
+int libdbase_read_spectrum_frame(FILE *fh, int32_t *spec){
+  if(fh == NULL || spec == NULL){
+    fprintf(stderr, "E: libdbase_read_spectrum_frame(), fh or spec was NULL\n");
+    return -1;
+  }
+  unsigned char buf[DBASE_FRAME_MAX];
+  int n = 0, m, c;
+  /* Tag and length, then the payload */
+  while(n < 3 && (c = fgetc(fh)) != EOF){
+    buf[n++] = (unsigned char) c;
+    if(n == 2 && (buf[1] & 0x80) == 0)
+      break;
+  }
+  if(n == 0)
+    return 0;
+  m = dbase_decode_spectrum(buf, n, spec, DBASE_LEN + 1);
+  if(m == 0 && n >= 2){
+    uint64_t plen;
+    if(dbase_get_varint(buf + 1, n - 1, &plen) < 0 || plen > DBASE_FRAME_MAX - 3)
+      m = -1;
+    else if(fread(buf + n, 1, plen, fh) == plen)
+      m = dbase_decode_spectrum(buf, n + (int) plen, spec, DBASE_LEN + 1);
+  }
+  if(m <= 0){
+    fprintf(stderr, "E: libdbase_read_spectrum_frame(), %s frame\n", 
+	    m == 0 ? "truncated" : "invalid");
+    return -1;
+  }
+  return 1;
+}
+
 /*
   Print (Region of Interest) part of spectrum (and returns sum in *sum)
   - if *fh is NULL only sum is calculated
@@ -743,15 +876,13 @@ void libdbase_print_roi(detector *det, uint start_ch, uint end_ch, uint *sum, FI
     printf("Channels %u:%u:\n", start_ch, end_ch);
   /* print roi channels */
   if(fh != NULL){
-    for(k = start_ch; k < end_ch; k++){
-      sum[0] += det->spec[k];
+    for(k = start_ch; k <= (int) end_ch; k++)
       fprintf(fh, "%d ", det->spec[k]);
-    }
     fprintf(fh,"\n");
   }
-  /* (and) sum roi */
-  for(k = start_ch; k < end_ch; k++)
-    sum[0] += det->spec[k];     
+  /* (and) sum roi, end_ch included */
+  for(k = start_ch; k <= (int) end_ch; k++)
+    sum[0] += det->spec[k];
 }
 
 /*
@@ -1210,6 +1341,9 @@ int libdbase_set_list_mode(detector *det){
   /* Clear live/real counters */
   libdbase_clear_counters(det);
 
+  /* New list mode run, clear readout statistics */
+  memset(&det->lm, 0, sizeof(lm_stats));
+
   /* Clear msb bit */
   det->status.CTRL &= (uint8_t) 0x7f;
 
@@ -1244,8 +1378,56 @@ int libdbase_read_lm_packets(detector *det, pulse *buf,
       fprintf(stderr,"E: libdbase_parse_lm_packets(), time pointer can't be null\n");
     return -1;
   }
-  int err, io;
+  int err, n;
   
+  /* Allocate temporary buffer */
+  uint32_t *tmp = malloc( len * sizeof(uint32_t) );
+  if(tmp == NULL) {
+    fprintf(stderr, "E: failed to allocate temporary buffer in libdbase_read_lm_packets()\n");
+    return -ENOMEM;
+  }
+
+  /* Read words, err is the number of events */
+  err = libdbase_read_lm_words(det, tmp, len, &n);
+  if(err < 0){
+    /* Make a clean exit */
+    free(tmp);
+    return err;
+  }
+
+  /*
+    Got n int32's from digibase,
+    but some int32's are timestamps.
+    Only count the number of events with amplitude, 
+    or parse additional information as well (amp, time)
+   */
+  if(det->lmf != NULL)
+    *read = dbase_decode_lm_filter(tmp, n, buf, time, det->lmf);
+  else
+    *read = buf == NULL ? err : dbase_decode_lm(tmp, n, buf, time);
+
+  /* Free internal buffer */
+  free(tmp);
+  /* Success */
+  return 0;
+}
+
+/*
+  Read raw list mode words
+
+  - words are in host byte order, cut at the end of data
+  - returns the number of events among the words,
+    the rest are time words
+*/
+int libdbase_read_lm_words(detector *det, uint32_t *words, int len, int *n){
+  if( check_detector(det, "libdbase_read_lm_words") < 0) return -1;
+  if(words == NULL || len <= 0 || n == NULL){
+    fprintf(stderr,"E: libdbase_read_lm_words(), invalid buffer or length\n");
+    return -1;
+  }
+  int err, io, k, m, p, ts = 0;
+  *n = 0;
+
   /* Request packets from digibase */
   err = dbase_write_one(det->dev, SPECTRUM, &io);
   if(err < 0 || io != 1){
@@ -1254,86 +1436,138 @@ int libdbase_read_lm_packets(detector *det, pulse *buf,
     return err;
   }
   
-  /* Allocate temporary buffer */
-  const int blen = len * sizeof(uint32_t);
-  uint32_t *tmp = malloc( blen );
-  if(tmp == NULL) {
-    fprintf(stderr, "E: failed to allocate temporary buffer in libdbase_read_lm_packets()\n");
-    return -ENOMEM;
-  }
-  
   /* 
      Read packets, 
      use libusb directly to avoid an additional buffer (in dbase_read()) 
   */
-  /*err = libusb_bulk_transfer(det->dev, EP_IN, (unsigned char*) tmp, len, &io, S_TIMEOUT);*/
   /* 2012-02-25: modified len to correct nbr of bytes */
-  err = libusb_bulk_transfer(det->dev, EP_IN, (unsigned char*) tmp, blen, &io, S_TIMEOUT);
+  err = libusb_bulk_transfer(det->dev, EP_IN, (unsigned char*) words, 
+			     len * sizeof(uint32_t), &io, S_TIMEOUT);
+  det->lm.reads++;
+  det->lm.flags = 0;
   if(err < 0){
     fprintf(stderr, "E: when reading list mode data (read %d bytes)\n", io);
     err_str("libdbase_parse_lm_packets()", err);
-    fprintf(stderr, "If you got an overflow error, try increasing the buffer size\n");
-    /* Make a clean exit */
-    free(tmp);
+    if(err == LIBUSB_ERROR_OVERFLOW){
+      /* More data than buffer, the FIFO is saturated */
+      det->lm.usb_overflows++;
+      det->lm.flags |= LM_OVERFLOW;
+      fprintf(stderr, "If you got an overflow error, try increasing the buffer size\n");
+    }
     return err;
   }
-  
-  /*
-    Got io/4 int32's from digibase,
-    but some int32's are timestamps.
-    Parsing is done here.
-   */
-  int k, r=0;
+  m = io/4;
+
   /* Swap bytes on BIG_E machines */
   if( IS_BIG_ENDIAN() ){
-    for(k=0; k < io/4; k++)
-      BYTESWAP(tmp[k]);
+    for(k=0; k < m; k++)
+      BYTESWAP(words[k]);
   }
-    
-  /* Only count the number of events with amplitude */
-  if(buf == NULL)
-  {
-    for(k=0; k < io/4; k++)
-      {
-	/* End of data? */
-	if(tmp[k] == 0)
-	  break;
-	if(tmp[k] <= TS_MASK)
-	  r++;
+
+  /* 
+     A readout that fills the buffer (or most of the FIFO) 
+     leaves data behind
+  */
+  if(m == len){
+    det->lm.full_reads++;
+    det->lm.flags |= LM_NEAR_OVERFLOW;
+  }
+  if(m > LM_FIFO_HWM){
+    det->lm.hwm_reads++;
+    det->lm.flags |= LM_NEAR_OVERFLOW;
+  }
+
+  /* End of data? */
+  for(k=0; k < m && words[k] != 0; k++)
+    ;
+  m = k;
+
+  /* Count time words (branch free), then account for them */
+  for(k=0; k < m; k++)
+    ts += words[k] >> 31;
+  p = -1;
+  if(ts > 0){
+    for(k=0; k < m; k++)
+      if(words[k] > TS_MASK){
+	dbase_lm_time_word(&det->lm, words[k] & TS_MASK, k - p - 1);
+	p = k;
       }
   }
-  /* Parse additional information as well (amp, time) */
-  else
-  {
-    for(k=0; k < io/4; k++)
-    {
-	/* End of data? */	
-	if(tmp[k] == 0)
-	  break;
- 	/* Amplitude & time? */
-	else if(tmp[k] <= TS_MASK){
-	  buf[r].amp =  (uint32_t) ((tmp[k] & A_MASK) >> 21);
-	  /* First time tick after (in worst case) MAX_T us */
-	  buf[r].time = (uint32_t) (tmp[k] & T_MASK);
-	  /* Timer rollover? */
-	  if(buf[r].time > MAX_T){
-	    buf[r].time -= MAX_T;
-	  }
-	  buf[r].time += time[0];
-	  r++;
-	}
-	/* Timestamp then */
-	else
-	  time[0] = (uint32_t) (tmp[k] & TS_MASK);
-      }
+  det->lm.ts_events += m - p - 1;
+  det->lm.words += m;
+  det->lm.events += m - ts;
+
+  /* Inter-arrival times */
+  if(det->lmi != NULL)
+    libdbase_lm_iat_feed(det->lmi, words, m);
+
+  *n = m;
+  return m - ts;
+}
+
+/*
+  Account for one list mode time word:
+  - time words should come every TS_STEP us, a longer
+    step means that words were lost in the FIFO
+  - lost events are estimated from the rate before the gap
+*/
+void dbase_lm_time_word(lm_stats *st, uint32_t ts, uint32_t ev){
+  uint32_t d, missing;
+  double lost;
+  st->ts_words++;
+  ev += st->ts_events;
+  st->ts_events = 0;
+  if(st->have_ts){
+    d = (ts - st->last_ts) & TS_MASK;
+    if(d > TS_STEP + TS_STEP / 2){
+      missing = (d + TS_STEP / 2) / TS_STEP - 1;
+      lost = st->rate * (double) missing * TS_STEP;
+      st->ts_gaps += missing;
+      st->lost += (uint64_t) lost;
+      /* Only a gap with events in it is a loss */
+      if(lost >= 1.0)
+	st->flags |= LM_OVERFLOW;
+      if(_DEBUG > 0)
+	printf("List mode: %u time words missing, ~%.0f events lost\n", missing, lost);
+    }
+    else if(d > 0)
+      st->rate = ev / (double) d;
   }
-  
-  /* Set number of read events */
-  *read = r;
-  /* Free internal buffer */
-  free(tmp);
-  /* Success */
-  return 0;
+  st->last_ts = ts;
+  st->have_ts = 1;
+}
+
+/*
+  Print list mode statistics to stream
+*/
+void libdbase_print_lm_stats(const detector *det, FILE *fh){
+  if(check_detector(det, "libdbase_print_lm_stats") < 0)
+    return;
+  if(fh == NULL){
+    fprintf(stderr, "E: libdbase_print_lm_stats(), *fh was NULL\n");
+    return;
+  }
+  const lm_stats *st = &det->lm;
+  fprintf(fh, 
+	  "======== LIST MODE (%d) =======\n"
+	  "Readouts          : %llu\n"
+	  "Events            : %llu\n"
+	  "Full readouts     : %llu\n"
+	  "Readouts > HWM    : %llu\n"
+	  "USB overflows     : %llu\n"
+	  "Missing time words: %llu\n"
+	  "Lost events (est.): %llu (%.3f %%)\n"
+	  "============================\n",
+	  det->serial,
+	  (unsigned long long) st->reads,
+	  (unsigned long long) st->events,
+	  (unsigned long long) st->full_reads,
+	  (unsigned long long) st->hwm_reads,
+	  (unsigned long long) st->usb_overflows,
+	  (unsigned long long) st->ts_gaps,
+	  (unsigned long long) st->lost,
+	  st->events + st->lost > 0 ? 
+	  100.0 * st->lost / (double) (st->events + st->lost) : 0.0);
 }
 
 /*
@@ -46,6 +46,7 @@ extern "C" {
 /*#define PROD_ID         0x000f*/   /* digiBASE */
 #define PROD_ID         0x001f       /*JK 0x001f digiBaseRH version ID*/
 #define DBASE_LEN       1023         /* digibase channels-1 */
+#define DBASE_FRAME_MAX (3 + 4 * (DBASE_LEN+1)) /* max spectrum frame bytes */
 
 /* 
    Status message:
@@ -108,6 +109,45 @@ typedef struct {
 } status_msg;
 /* #pragma pack() */
 
+/*
+  List mode FIFO.
+  The device buffers list mode words in a 128 kB FIFO, readouts
+  should keep it below the high-water mark.
+*/
+#define LM_FIFO_WORDS   32768               /* 32-bit words */
+#define LM_FIFO_HWM     (LM_FIFO_WORDS / 2) /* high-water mark */
+
+/* List mode status flags (lm_stats.flags) */
+#define LM_NEAR_OVERFLOW 0x01     /* last readout filled the buffer or passed the HWM */
+#define LM_OVERFLOW      0x02     /* last readout showed lost data */
+
+/*
+  List mode readout statistics, per detector.
+  Updated by libdbase_read_lm_packets() and cleared by
+  libdbase_set_list_mode().
+
+  The device sends a time word every 2^20 us, so a missing
+  time word means that the FIFO overflowed and data were lost.
+  The number of lost events is estimated from the event rate
+  before the gap.
+*/
+typedef struct {
+  uint64_t reads;           /* readouts */
+  uint64_t words;           /* words read */
+  uint64_t events;          /* events read */
+  uint64_t full_reads;      /* readouts that filled the whole buffer */
+  uint64_t hwm_reads;       /* readouts with more than LM_FIFO_HWM words */
+  uint64_t usb_overflows;   /* libusb overflow errors */
+  uint64_t ts_words;        /* time words */
+  uint64_t ts_gaps;         /* missing time words */
+  uint64_t lost;            /* estimated lost events */
+  double rate;              /* event rate between time words (events/us) */
+  uint32_t last_ts;         /* last time word */
+  uint32_t ts_events;       /* events since last time word */
+  int have_ts;              /* last_ts is valid */
+  int flags;                /* LM_X flags of last readout */
+} lm_stats;
+
 /*
   Detector (digibase MCA/B) struct
 */
@@ -115,10 +155,109 @@ typedef struct {
   int serial;                     /* digibase's Serial number */
   libusb_device_handle *dev;      /* underlying libusb device handle */
   status_msg status;              /* status struct */
+  lm_stats lm;                    /* list mode readout statistics */
+  struct lm_filter *lmf;          /* list mode filter (not owned), or NULL */
+  struct lm_iat *lmi;             /* inter-arrival histogram (not owned), or NULL */
+  struct spec_snap *snap;         /* spectrum snapshots (not owned), or NULL */
+  struct roi_set *rois;           /* ROI registry (not owned), or NULL */
+  struct spec_window *win;        /* sliding window spectrum (not owned), or NULL */
+  struct spec_pyramid *pyr;       /* spectrum time pyramid (not owned), or NULL */
+  struct spec_accum *acc;         /* 64-bit spectrum accumulator (not owned), or NULL */
+  struct spec_calib *cal;         /* energy calibration (not owned), or NULL */
+  struct spec_peaks *peaks;       /* peak tracker (not owned), or NULL */
   int32_t spec[DBASE_LEN+1];      /* spectrum */
   int32_t last_spec[DBASE_LEN+1]; /* diff spectrum (difference since last readout) */
+  int spec_cleared;               /* spectrum cleared since the last readout */
 } detector;
 
+/*
+  Spectrum snapshot, a consistent copy of det->spec and
+  det->last_spec as of one libdbase_get_spectrum()
+*/
+typedef struct {
+  uint64_t seq;                   /* readout number, 1, 2, ... */
+  uint64_t time;                  /* host time of the readout (CLOCK_MONOTONIC, us) */
+  int32_t spec[DBASE_LEN+1];      /* spectrum */
+  int32_t last_spec[DBASE_LEN+1]; /* diff spectrum */
+} spec_snapshot;
+
+/*
+  Snapshot publisher, see libdbase_snap_X functions below
+*/
+typedef struct spec_snap spec_snap;
+
+/*
+  Sliding window spectrum, see libdbase_window_X functions below
+*/
+typedef struct spec_window spec_window;
+
+/*
+  Spectrum time pyramid, see libdbase_pyramid_X functions below
+*/
+typedef struct spec_pyramid spec_pyramid;
+
+/*
+  64-bit spectrum accumulator, see libdbase_accum_X functions below
+*/
+typedef struct spec_accum spec_accum;
+
+/*
+  Energy calibration and rebinning, see libdbase_calib_X functions below
+*/
+typedef struct spec_calib spec_calib;
+
+/*
+  Tracked peak. Channels are positions (channel k at k), fwhm
+  and the centroid from the background subtracted counts in
+  lo..hi. The id stays with the peak across re-scans.
+*/
+typedef struct {
+  int id;
+  double centroid;          /* channel */
+  double fwhm;              /* channels */
+  double net;               /* counts above background */
+  double err;               /* std dev of net */
+  double bg;                /* background under the peak */
+  uint lo, hi;              /* channels used (inclusive) */
+} peak_info;
+
+/*
+  Peak tracker, see libdbase_peaks_X functions below
+*/
+typedef struct spec_peaks spec_peaks;
+
+/*
+  ROI registry, see libdbase_roi_X functions below
+*/
+typedef struct roi_set roi_set;
+
+/*
+  Spectrum store record, fixed size, as mapped from the file
+*/
+typedef struct {
+  uint64_t time;                  /* host wall time (us since the epoch) */
+  uint64_t seq;                   /* record number, 0, 1, ... */
+  status_msg status;              /* status at the readout */
+  int32_t spec[DBASE_LEN+1];      /* spectrum */
+} spec_record;
+
+/*
+  Spectrum store, see libdbase_store_X functions below
+*/
+typedef struct spec_store spec_store;
+
+/*
+  ROI sums. Net is gross minus a linear background through the 
+  mean of 'bg' channels on each side of the ROI, err is the
+  standard deviation of net from counting statistics.
+*/
+typedef struct {
+  int64_t gross;            /* counts in ROI */
+  double bg;                /* background under the ROI */
+  double net;               /* gross - bg */
+  double err;               /* std dev of net */
+} roi_result;
+
 /*
   List-mode pulse struct.
   each event (pulse) contains amplitude and time information
@@ -129,6 +268,120 @@ typedef struct {
   uint32_t time;            /* Pulse arrival time (us) */
 } pulse;
 
+/*
+  Unwrapped list-mode event.
+  Same information as a pulse, but the 32-bit device time is
+  extended to 64 bits so that it does not roll over.
+  (16 bytes)
+*/
+typedef struct {
+  uint64_t time;            /* Pulse arrival time (us), unwrapped */
+  uint32_t amp;             /* Pulse amplitude (a.u.) */
+  uint32_t det;             /* Detector (stream) index, 0 for one detector */
+} lm_event;
+
+/*
+  List-mode archive (binary list-mode file), see
+  libdbase_lm_archive_X functions below
+*/
+typedef struct lm_archive lm_archive;
+
+/*
+  List mode event filter, see libdbase_lm_filter_X functions below
+*/
+typedef struct lm_filter lm_filter;
+
+/*
+  Time-sliced spectra from list mode, see libdbase_lm_spectra_X 
+  functions below
+*/
+typedef struct lm_spectra lm_spectra;
+
+/*
+  Coincidence groups, from libdbase_lm_coinc_get().
+  Events (from several detectors) within the coincidence window
+  of the first one, ev[k].det is the detector index.
+*/
+#define LM_COINC_MAX    32         /* max detectors, and events per group */
+
+typedef struct {
+  uint64_t time;            /* time of first event (us) */
+  uint32_t mask;            /* bit d set if detector d has an event */
+  int n;                    /* number of events */
+  lm_event ev[LM_COINC_MAX];
+} lm_group;
+
+/*
+  Coincidence engine, see libdbase_lm_coinc_X functions below
+*/
+typedef struct lm_coinc lm_coinc;
+
+/*
+  Device to host clock model, see libdbase_lm_clock_X functions below
+*/
+typedef struct lm_clock lm_clock;
+
+/*
+  Rossi-alpha and Feynman-Y estimators, see libdbase_lm_rossi_X 
+  and libdbase_lm_feynman_X functions below
+*/
+typedef struct lm_rossi lm_rossi;
+typedef struct lm_feynman lm_feynman;
+
+/*
+  Inter-arrival time histogram and dead time estimator,
+  see libdbase_lm_iat_X functions below
+*/
+typedef struct lm_iat lm_iat;
+
+#define LM_IAT_BINS     256        /* log bins: 16 linear (1 us), then 8 per octave */
+
+/*
+  Dead time estimate from the inter-arrival times.
+  Intervals longer than the tail start are exponential with the
+  true rate, the dead time is from the non-paralyzable model
+  measured = true / (1 + true * tau).
+*/
+typedef struct {
+  uint64_t events;          /* events */
+  double rate;              /* measured rate (1/s) */
+  double true_rate;         /* rate from the exponential tail (1/s) */
+  double dead;              /* dead time fraction, 1 - rate/true_rate */
+  double tau;               /* dead time per event (us) */
+  double pileup;            /* probability of a second event within tau */
+  double lt_dead;           /* dead time fraction from status LT/RT, <0 if unknown */
+} lm_deadtime;
+
+/*
+  Synthetic list mode word generator, see libdbase_lm_gen_X
+  functions below.
+  Event times are a Poisson process of 'rate' events/s, where an
+  event starts a burst with probability 'burst': burst_len more 
+  events (mean) follow, burst_gap us apart (mean).
+  A fraction peak_frac of the amplitudes is normal (peak, sigma)
+  and the rest is uniform over all channels.
+  A fraction 'rollover' of the events is written with the
+  time field past MAX_T, as the device does around timer rollovers.
+*/
+typedef struct {
+  uint64_t seed;            /* same seed, same words */
+  double rate;              /* mean event rate (1/s) */
+  double peak;              /* peak amplitude (channel) */
+  double sigma;             /* peak width (channels) */
+  double peak_frac;         /* fraction of events in the peak */
+  double burst;             /* probability of a burst */
+  double burst_len;         /* mean extra events per burst */
+  double burst_gap;         /* mean time between burst events (us) */
+  double rollover;          /* fraction of time fields past MAX_T */
+} lm_gen_cfg;
+
+typedef struct lm_gen lm_gen;
+
+/*
+  Multichannel scaler (MCS), see libdbase_lm_mcs_X functions below
+*/
+typedef struct lm_mcs lm_mcs;
+
 /*
   STATUS MACROS
   can be used to check status of dbase
@@ -140,6 +393,9 @@ typedef struct {
 #define IS_GS_ON(x)     (((x)->status.CTRL & 0x10) > 0)
 #define IS_ZS_ON(x)     (((x)->status.CTRL & 0x20) > 0)
 #define IS_HV_ON(x)     (((x)->status.CTRL & 0x40) > 0)
+/* List mode FIFO status of last readout */
+#define IS_LM_NEAR_OVERFLOW(x) (((x)->lm.flags & LM_NEAR_OVERFLOW) > 0)
+#define IS_LM_OVERFLOW(x)      (((x)->lm.flags & LM_OVERFLOW) > 0)
 
 /* This bit is set only when startup is complete */
 //#define IS_READY(x)     (((x)->status.RDY & 0x08) > 0)
@@ -237,6 +493,10 @@ int libdbase_set_status(detector *det);
     For both return types 'time' is used to track digibase's internal
     timer overflow. At first call 'time' should point to an uint32_t
     set to 0.
+
+    Each call updates det->lm. When IS_LM_NEAR_OVERFLOW(det) or
+    IS_LM_OVERFLOW(det) is set after a call, the FIFO may still hold
+    data and should be read again immediately.
    */
 int libdbase_read_lm_packets(detector *det,   /* the detector pointer */
 			pulse *buf,      /* pulse buffer (can be NULL) */
@@ -244,6 +504,329 @@ int libdbase_read_lm_packets(detector *det,   /* the detector pointer */
 			int *read,       /* returns the read nbr of events */
 			uint32_t *time); /* timer pointer to track internal overflow */
 
+  /*
+    Read raw list mode words (host byte order) into words,
+    at most len words. Number of words is returned through *n.
+    This is the readout part of libdbase_read_lm_packets(), 
+    it updates det->lm the same way.
+    Returns number of events among the words, or <0 on error.
+   */
+int libdbase_read_lm_words(detector *det, uint32_t *words, int len, int *n);
+
+  /*
+    List mode filter:
+
+    Events are filtered on amplitude (any number of [low, high] 
+    ranges) and time (up to 256 windows [start, end) in us after
+    the first time word decoded with the filter attached; times are
+    unwrapped, so windows don't fire again after a rollover). Events
+    before that first time word fail any window. A new filter 
+    accepts all events, the first range/window limits it to the 
+    given ones.
+    A filter attached to a detector with libdbase_set_lm_filter() is
+    applied while decoding in libdbase_read_lm_packets(), so rejected
+    events are never stored or counted. The filter is not freed by
+    libdbase_close().
+  */
+lm_filter *libdbase_lm_filter_new(void);
+void libdbase_lm_filter_free(lm_filter *f);
+  /* Accept amplitudes low..high (inclusive) */
+int libdbase_lm_filter_amp(lm_filter *f, uint32_t low, uint32_t high);
+  /* Accept times start <= t < end, windows can be added in any order */
+int libdbase_lm_filter_window(lm_filter *f, uint32_t start, uint32_t end);
+  /* Number of accepted and rejected events (can be NULL) */
+void libdbase_lm_filter_stats(const lm_filter *f, uint64_t *passed, uint64_t *rejected);
+  /* Attach filter f to det, NULL removes it */
+int libdbase_set_lm_filter(detector *det, lm_filter *f);
+
+  /*
+    Multichannel scaling (MCS):
+
+    Events are binned by their device time into bins of 'dwell' us,
+    bin k holds the counts in [k*dwell, (k+1)*dwell) of (unwrapped)
+    device time, which does not start at 0. The first bin is the one
+    of the first time word, events read before it can't be timed 
+    and are not counted. The bins are independent of how often the
+    device is read. Bins are complete once a later time has been seen.
+
+    Create MCS with a ring of nbins bins (bins not fetched in time
+    are dropped), returns NULL on failure.
+  */
+lm_mcs *libdbase_lm_mcs_new(uint32_t dwell, int nbins);
+  /* Free MCS */
+void libdbase_lm_mcs_free(lm_mcs *mcs);
+  /* Bin n raw words (from libdbase_read_lm_words()) */
+int libdbase_lm_mcs_feed(lm_mcs *mcs, const uint32_t *words, int n);
+  /* 
+     Read from device and bin, words is a buffer of len words.
+     Returns number of events read, <0 on error 
+  */
+int libdbase_read_lm_mcs(detector *det, lm_mcs *mcs, uint32_t *words, int len);
+  /* 
+     Fetch up to len completed bins into counts, the number of the
+     first one is returned through *first (can be NULL).
+     Returns number of fetched bins.
+  */
+int libdbase_lm_mcs_get(lm_mcs *mcs, uint32_t *counts, int len, uint64_t *first);
+  /* Mark all bins up to the latest event as complete (end of run) */
+void libdbase_lm_mcs_finish(lm_mcs *mcs);
+
+  /*
+    Time-sliced spectra:
+
+    Spectra (DBASE_LEN+1 channels) are histogrammed directly from
+    the raw list mode words, one per slice of 'slice' us: slice k
+    holds the events in [k*slice, (k+1)*slice) of (unwrapped) device
+    time. The first slice is the one of the first time word, events
+    read before it can't be timed and are not counted. A slice is
+    complete when a later time has been seen, empty slices are also
+    returned.
+
+    Create, returns NULL on failure.
+  */
+lm_spectra *libdbase_lm_spectra_new(uint64_t slice);
+void libdbase_lm_spectra_free(lm_spectra *s);
+  /* Histogram n raw words (from libdbase_read_lm_words()) */
+int libdbase_lm_spectra_feed(lm_spectra *s, const uint32_t *words, int n);
+  /* 
+     Read from device and histogram, words is a buffer of len words.
+     Returns number of events read, <0 on error 
+  */
+int libdbase_read_lm_spectra(detector *det, lm_spectra *s, uint32_t *words, int len);
+  /* 
+     Get the next completed slice into spec (DBASE_LEN+1 channels), 
+     its start time (us) through *start (can be NULL).
+     Returns 1 if a slice was returned, 0 if none is complete.
+  */
+int libdbase_lm_spectra_get(lm_spectra *s, int32_t *spec, uint64_t *start);
+  /* Complete the slice being filled (end of run) */
+void libdbase_lm_spectra_finish(lm_spectra *s);
+  /* Print slice starting at start (us) to fh, as ASCII or binary */
+void libdbase_print_lm_spectrum(const int32_t *spec, uint64_t start, FILE *fh, int binary);
+
+  /*
+    Coincidence engine:
+
+    Pulses from ndet detectors are pushed per detector, their 32-bit
+    times are unwrapped and corrected with a per-detector offset (us).
+    The streams are merged in time order (each detector has a reorder
+    buffer, for events that arrive slightly out of order) and events 
+    within 'window' us of the first event of a group are grouped.
+    An event is merged only when all detectors have reached past it, 
+    so every detector should be pushed after each readout, also 
+    without pulses.
+
+    Coincidence: groups with events from at least 'mult' detectors 
+    are returned.
+    Anti-coincidence (libdbase_lm_coinc_veto()): groups with an event
+    from a veto detector are dropped, the others are returned 
+    (without the veto events), mult still applies.
+
+    Create, returns NULL on failure.
+  */
+lm_coinc *libdbase_lm_coinc_new(int ndet, uint64_t window, int mult);
+void libdbase_lm_coinc_free(lm_coinc *c);
+  /* Time offset (us) added to the times of detector d */
+int libdbase_lm_coinc_offset(lm_coinc *c, int d, int64_t offset);
+  /* Set veto detectors (bit d = detector d), 0 for coincidence mode */
+int libdbase_lm_coinc_veto(lm_coinc *c, uint32_t mask);
+  /* 
+     Push n pulses of detector d, time is the *time of 
+     libdbase_read_lm_packets() (the detector has reached it).
+  */
+int libdbase_lm_coinc_push(lm_coinc *c, int d, const pulse *p, int n, uint32_t time);
+  /* Get up to len completed groups, returns number of groups */
+int libdbase_lm_coinc_get(lm_coinc *c, lm_group *g, int len);
+  /* Merge all buffered events (end of run) */
+int libdbase_lm_coinc_finish(lm_coinc *c);
+
+  /*
+    Clock model:
+
+    Maps (unwrapped) device time to host time, CLOCK_MONOTONIC in us.
+    The model host = offset + rate * device is fitted by weighted 
+    least squares over (device time, host time) samples, older 
+    samples are forgotten with a time constant of 'span' us of 
+    device time. libdbase_read_lm_events() samples the model at 
+    every readout with new words: the latest device time in the
+    readout (its last event or time word) against the host time at 
+    the end of the transfer. The host time is late by the time from
+    that event to the end of the transfer: the USB transfer plus
+    about the mean event spacing, which at low rates grows towards 
+    the poll interval (up to 2^20 us without events).
+
+    Create, id is put in lm_event.det. Returns NULL on failure.
+  */
+lm_clock *libdbase_lm_clock_new(uint32_t id, uint64_t span);
+void libdbase_lm_clock_free(lm_clock *clk);
+  /* Add a sample */
+int libdbase_lm_clock_sample(lm_clock *clk, uint64_t device, uint64_t host);
+  /* Host time of device time (device time if no samples yet) */
+uint64_t libdbase_lm_clock_host(const lm_clock *clk, uint64_t device);
+  /* 
+     Model parameters: rate deviation (ppm, device clock relative 
+     to host) and number of samples, pointers can be NULL.
+     Returns 0 if the model is fitted (2 samples or more), else 1.
+  */
+int libdbase_lm_clock_info(const lm_clock *clk, double *ppm, uint64_t *samples);
+  /* Current host time, CLOCK_MONOTONIC (us) */
+uint64_t libdbase_host_time_us(void);
+  /*
+    Read list mode events in host time: as libdbase_read_lm_packets(),
+    but times are unwrapped and mapped through the model clk, which
+    is updated with the readout. Number of events through *read.
+  */
+int libdbase_read_lm_events(detector *det, lm_clock *clk, lm_event *buf, 
+			    int len, int *read);
+
+  /*
+    Rossi-alpha:
+
+    Histogram of the time differences between every event and the 
+    later events within nbins * width us, bin k holds differences 
+    in [k*width, (k+1)*width). Recent events are kept in a ring, so
+    each event costs the number of events within the window.
+    Fed with decoded pulses (libdbase_read_lm_packets()).
+  */
+lm_rossi *libdbase_lm_rossi_new(uint64_t width, int nbins);
+void libdbase_lm_rossi_free(lm_rossi *r);
+int libdbase_lm_rossi_feed(lm_rossi *r, const pulse *p, int n);
+  /* Copy histogram (up to len bins), returns number of bins */
+int libdbase_lm_rossi_get(const lm_rossi *r, uint64_t *hist, int len);
+
+  /*
+    Feynman-Y:
+
+    Counts in consecutive gates of width k*gate us (k = 1..ngates),
+    the moment sums of the counts are updated when a gate closes,
+    at a cost of one increment per event and ngates updates per
+    'gate' us. Gates start at the first event.
+  */
+lm_feynman *libdbase_lm_feynman_new(uint64_t gate, int ngates);
+void libdbase_lm_feynman_free(lm_feynman *f);
+int libdbase_lm_feynman_feed(lm_feynman *f, const pulse *p, int n);
+  /* 
+     Y = var/mean - 1 for the len (at most ngates) first gate widths,
+     mean count per gate through mean (can be NULL). Gate widths 
+     without closed gates get Y = 0. Returns number of widths.
+  */
+int libdbase_lm_feynman_y(const lm_feynman *f, double *y, double *mean, int len);
+
+  /*
+    Inter-arrival times:
+
+    Log-binned histogram (LM_IAT_BINS) of the time between 
+    consecutive events, and sums for the dead time estimate.
+    tail (us) is where the exponential tail starts, it must be
+    well above the dead time (a few pulse widths). Events before 
+    the first time word, and the interval across a rollover or 
+    missing time words (lost data), are not used.
+    Attached to a detector with libdbase_set_lm_iat() it is
+    updated by every list mode readout. Not freed by libdbase_close().
+  */
+lm_iat *libdbase_lm_iat_new(uint64_t tail);
+void libdbase_lm_iat_free(lm_iat *iat);
+  /* Attach iat to det, NULL removes it */
+int libdbase_set_lm_iat(detector *det, lm_iat *iat);
+  /* Add n raw words (from libdbase_read_lm_words()) */
+int libdbase_lm_iat_feed(lm_iat *iat, const uint32_t *words, int n);
+  /* Copy histogram (up to len bins), returns number of bins */
+int libdbase_lm_iat_hist(const lm_iat *iat, uint64_t *hist, int len);
+  /* Lower edge (us) of bin k */
+uint64_t libdbase_lm_iat_edge(int k);
+  /* 
+     Dead time estimate, det (can be NULL) gives the LT/RT 
+     dead time of its last status (see libdbase_get_status())
+  */
+int libdbase_lm_iat_estimate(const lm_iat *iat, const detector *det, lm_deadtime *est);
+  /* Print dead time estimate to stream */
+void libdbase_print_lm_deadtime(const lm_iat *iat, const detector *det, FILE *fh);
+
+  /*
+    Format spectrum (len channels) as one ASCII line, as
+    printed by libdbase_print_file_spectrum(), into buf of
+    size bytes (12 * len + 1 is always enough).
+    Returns number of bytes, or -1 if buf is too small.
+  */
+int libdbase_format_spectrum(const int32_t *spec, int len, char *buf, int size);
+
+  /*
+    Decode n raw words without a device, as libdbase_read_lm_packets():
+    buf NULL only counts the events, else the pulses are stored
+    and *time tracks the last time word. Returns number of events.
+  */
+int libdbase_decode_lm_words(const uint32_t *words, int n, pulse *buf, uint32_t *time);
+
+  /*
+    Synthetic list mode words (see lm_gen_cfg):
+    create generator, returns NULL on failure
+  */
+lm_gen *libdbase_lm_gen_new(const lm_gen_cfg *cfg);
+void libdbase_lm_gen_free(lm_gen *g);
+  /* Default configuration: 10 kcps, 30 % in a peak at channel 400 */
+void libdbase_lm_gen_defaults(lm_gen_cfg *cfg);
+  /*
+    Fill words with the next len-1 words (or fewer, covering at 
+    most 'span' us, 0 = no limit) and a zero terminator, as one 
+    device readout. Returns number of words before the terminator,
+    the number of events is returned through *events (can be NULL).
+  */
+int libdbase_lm_gen_words(lm_gen *g, uint32_t *words, int len, uint64_t span, int *events);
+
+  /* Print list mode readout statistics (det->lm) to stream */
+void libdbase_print_lm_stats(const detector *det, FILE *fh);
+
+  /*
+     List-mode archive functions:
+
+     Binary list-mode files are written in fixed-size blocks
+     (64 kB). Each block holds delta-encoded
+     times and amplitudes as varints, and starts with the time of
+     its first event. A block index is appended when the archive
+     is closed, so a reader can seek to any time without scanning
+     the file. Files that were never closed (e.g. after a crash)
+     are still readable, the index is then rebuilt from the block
+     headers.
+
+     Open an archive for writing on stream fh (stdout works),
+     returns NULL on failure.
+  */
+lm_archive *libdbase_lm_archive_open_write(FILE *fh, int serial);
+  /* 
+     Append n pulses (as returned by libdbase_read_lm_packets()),
+     the 32-bit times are unwrapped to 64-bit times.
+  */
+int libdbase_lm_archive_write(lm_archive *ar, const pulse *buf, int n);
+  /* 
+     Feed the latest time word (the *time of libdbase_read_lm_packets())
+     to the unwrapping, so that rollovers are tracked also through
+     quiet periods without events. Call it after each readout.
+  */
+int libdbase_lm_archive_time(lm_archive *ar, uint32_t time);
+  /* 
+     Close an archive, when writing the last block and the index
+     are written first. The stream fh is not closed.
+  */
+int libdbase_lm_archive_close(lm_archive *ar);
+  /* Open an archive for reading, fh must be seekable */
+lm_archive *libdbase_lm_archive_open_read(FILE *fh);
+  /* 
+     Position the reader at the first event with time >= time,
+     returns <0 if time is past the last block.
+  */
+int libdbase_lm_archive_seek(lm_archive *ar, uint64_t time);
+  /* 
+     Read up to len events into buf, number of read events is 
+     returned through *read (0 at end of file)
+  */
+int libdbase_lm_archive_read(lm_archive *ar, lm_event *buf, int len, int *read);
+  /* 
+     Archive info: serial number, number of events and the time
+     of the first event (any pointer can be NULL)
+  */
+int libdbase_lm_archive_info(const lm_archive *ar, int *serial, 
+			     uint64_t *events, uint64_t *first);
+
   /* 
      Misc functions: helpers, prints etc 
   
@@ -271,7 +854,8 @@ void libdbase_print_file_status(const status_msg * status, const int serial, FIL
      prints all channels separated by space: " ".
      They actually print the det->spec or det->last_spec buffers
      so, these functions should be preceded with a call to
-     libdbase_get_spectrum()
+     libdbase_get_spectrum(). The ASCII ones don't flush the
+     stream, call fflush() once all output of a readout is written.
    */
   /* Print diff spectrum (to stdout) */ 
 void libdbase_print_spectrum(const detector *det);
@@ -286,9 +870,31 @@ void libdbase_print_file_spectrum_binary(const detector *det, FILE *fh);
   /* Print binary differential spectrum (to stream) */
 void libdbase_print_diff_file_spectrum_binary(const detector *det, FILE *fh);
 
+  /*
+     Spectrum frames: binary spectra that are written sparse, as
+     (zero channels skipped, value) varint pairs, when only a few
+     channels are nonzero (a low rate diff spectrum is a few 
+     hundred bytes instead of 4 kB), and dense (LE int32) 
+     otherwise. Each frame is at most DBASE_FRAME_MAX bytes.
+
+     Print spectrum / differential spectrum frame (to stream)
+  */
+void libdbase_print_file_spectrum_sparse(const detector *det, FILE *fh);
+void libdbase_print_diff_file_spectrum_sparse(const detector *det, FILE *fh);
+  /* Encode spec (DBASE_LEN+1 channels) into buf, returns bytes */
+int libdbase_encode_spectrum(const int32_t *spec, unsigned char *buf);
+  /* 
+     Decode the frame at buf (n bytes available) into spec 
+     (DBASE_LEN+1 channels), returns bytes used, 0 if the frame
+     is incomplete or <0 if it is invalid
+  */
+int libdbase_decode_spectrum(const unsigned char *buf, int n, int32_t *spec);
+  /* Read the next frame from stream, returns 1, 0 at end of file or <0 */
+int libdbase_read_spectrum_frame(FILE *fh, int32_t *spec);
+
   /* 
-     Sum region and optionally, if [fh != NULL],
-     print region of interest
+     Sum region start_ch..end_ch (inclusive) and optionally, 
+     if [fh != NULL], print region of interest
   */
 void libdbase_print_roi(detector *det, uint start_ch, uint end_ch, uint *sum, FILE *fh);
 
@@ -380,6 +986,249 @@ int libdbase_save_status_text(detector *det, const char* dir);
 //int libdbase_load_status(detector *det, const char *dir);
 int libdbase_load_status_text(detector *det, const char* dir);
 
+/*
+  Spectrum snapshots:
+
+  With a spec_snap attached (libdbase_set_snap()), every 
+  libdbase_get_spectrum() publishes det->spec and det->last_spec
+  with a sequence number and time. Other threads read the latest
+  snapshot with libdbase_snap_read() without locks: the copy is
+  retried if a readout was published meanwhile, the acquisition
+  thread never waits for readers.
+  The spec_snap is not freed by libdbase_close().
+*/
+spec_snap *libdbase_snap_new(void);
+void libdbase_snap_free(spec_snap *snap);
+  /* Attach snap to det, NULL removes it */
+int libdbase_set_snap(detector *det, spec_snap *snap);
+  /* Sequence number of the latest snapshot, 0 if none */
+uint64_t libdbase_snap_seq(const spec_snap *snap);
+  /* Copy latest snapshot to out, returns 0, or 1 if there is none yet */
+int libdbase_snap_read(const spec_snap *snap, spec_snapshot *out);
+
+/*
+  Sliding window spectrum:
+
+  Keeps the last nslots diff spectra (det->last_spec) in a ring
+  and their sum, which is updated by adding the newest and 
+  subtracting the ones that leave the window, so the window 
+  spectrum costs O(channels) per readout. With span > 0 (us) 
+  the window holds the readouts of the last span us only
+  ("last 60 s": span / interval readouts).
+  Attached to a detector (libdbase_set_window()) it is pushed by
+  every libdbase_get_spectrum(). Not freed by libdbase_close().
+*/
+spec_window *libdbase_window_new(int nslots, uint64_t span);
+void libdbase_window_free(spec_window *w);
+  /* Attach w to det, NULL removes it */
+int libdbase_set_window(detector *det, spec_window *w);
+  /* Add diff spectrum (DBASE_LEN+1 channels) read at time (us) */
+int libdbase_window_push(spec_window *w, const int32_t *diff, uint64_t time);
+  /* 
+     Window spectrum into spec (DBASE_LEN+1 channels), time of the
+     oldest and newest readouts through t0 and t1 (can be NULL).
+     Returns number of readouts in the window.
+  */
+int libdbase_window_get(const spec_window *w, int32_t *spec, uint64_t *t0, uint64_t *t1);
+  /* Empty the window */
+void libdbase_window_clear(spec_window *w);
+
+/*
+  Spectrum time pyramid:
+
+  Diff spectra summed at nlev aggregation levels, e.g. 
+  dur = {0, 10 s, 60 s, 3600 s} in us: level k keeps its last cap
+  nodes, each the sum of the readouts ending in one dur[k] long
+  bucket (dur[k] = 0: one node per readout). Every push adds to
+  the newest node of each level, so memory is bounded and the
+  aggregates are never rebuilt. A query takes whole nodes from
+  the coarsest level down, so with each dur a multiple of the
+  previous one a range costs a few nodes per level.
+  Attached to a detector (libdbase_set_pyramid()) it is pushed by
+  every libdbase_get_spectrum(). Not freed by libdbase_close().
+*/
+spec_pyramid *libdbase_pyramid_new(const uint64_t *dur, int nlev, int cap);
+void libdbase_pyramid_free(spec_pyramid *p);
+  /* Attach p to det, NULL removes it */
+int libdbase_set_pyramid(detector *det, spec_pyramid *p);
+  /* Add diff spectrum (DBASE_LEN+1 channels) read at time (us) */
+int libdbase_pyramid_push(spec_pyramid *p, const int32_t *diff, uint64_t time);
+  /* 
+     Sum of the readouts within [t0, t1] (us, a readout spans from
+     the previous one) into spec (DBASE_LEN+1 channels), the time
+     actually covered through c0 and c1 (can be NULL, c0 > c1 if
+     nothing is left of the range). Returns the number of nodes
+     summed, or -1 on error.
+  */
+int libdbase_pyramid_query(const spec_pyramid *p, uint64_t t0, uint64_t t1, 
+			   int64_t *spec, uint64_t *c0, uint64_t *c1);
+  /* Forget all readouts */
+void libdbase_pyramid_clear(spec_pyramid *p);
+
+/*
+  64-bit spectrum accumulator:
+
+  Counts per channel since an epoch, kept on the host, so the
+  device spectrum can be cleared (libdbase_clear_spectrum(), 
+  libdbase_clear_all()) for interval statistics without losing
+  the long-run integral. Each readout adds the increase of the
+  device counters (mod 2^32, so counter wrap is harmless); a 
+  drop of 2^31 or more is taken as a clear made elsewhere and
+  the new counts are added. The first readout after attaching
+  (libdbase_set_accum()) is the baseline, so re-initialising a
+  detector and attaching again does not count anything twice.
+  Accumulators can be saved to and loaded from file to span 
+  several runs. Not freed by libdbase_close().
+*/
+spec_accum *libdbase_accum_new(void);
+void libdbase_accum_free(spec_accum *acc);
+  /* Attach acc to det, NULL removes it */
+int libdbase_set_accum(detector *det, spec_accum *acc);
+  /* Add the device spectrum spec (DBASE_LEN+1 channels) */
+int libdbase_accum_feed(spec_accum *acc, const int32_t *spec);
+  /* Zero the totals and start a new epoch (us, wall time; 0 = now) */
+void libdbase_accum_reset(spec_accum *acc, uint64_t epoch);
+  /* 
+     Totals into spec (DBASE_LEN+1 channels, can be NULL), the
+     epoch through *epoch (can be NULL). Returns total counts.
+  */
+uint64_t libdbase_accum_get(const spec_accum *acc, uint64_t *spec, uint64_t *epoch);
+  /* Save to / load from file, load returns NULL on failure */
+int libdbase_accum_save(const spec_accum *acc, const char *path);
+spec_accum *libdbase_accum_load(const char *path);
+
+/*
+  Energy calibration and rebinning:
+
+  A detector's calibration E(x) = c[0] + c[1] x + ... (up to 
+  CALIB_MAX_COEF coefficients, channel k spans x = k-0.5..k+0.5,
+  E increasing) is turned once into a sparse rebinning matrix
+  onto a common grid of nbins energy bins e0..e1: each bin takes
+  the overlapping fraction of a few consecutive channels. The
+  matrix is applied with a 4-wide vector kernel, so spectra of 
+  detectors with different gains can be summed or compared 
+  directly on every readout.
+  Attached to a detector (libdbase_set_calib()) every 
+  libdbase_get_spectrum() rebins det->spec, see 
+  libdbase_calib_get(). Not freed by libdbase_close().
+
+  Returns NULL if E is not increasing or the grid is invalid.
+*/
+#define CALIB_MAX_COEF 4
+spec_calib *libdbase_calib_new(const double *coef, int ncoef, 
+			       double e0, double e1, int nbins);
+void libdbase_calib_free(spec_calib *cal);
+  /* Attach cal to det, NULL removes it */
+int libdbase_set_calib(detector *det, spec_calib *cal);
+  /* Energy at channel position x */
+double libdbase_calib_energy(const spec_calib *cal, double x);
+  /* 
+     Rebin spec (DBASE_LEN+1 channels) into out (nbins), _add adds 
+     to out. Returns nbins, or -1 on error.
+  */
+int libdbase_calib_rebin(const spec_calib *cal, const int32_t *spec, double *out);
+int libdbase_calib_rebin_add(const spec_calib *cal, const int32_t *spec, double *out);
+  /* Rebinned spectrum of the last readout (nbins through *nbins) */
+const double *libdbase_calib_get(const spec_calib *cal, int *nbins);
+
+/*
+  Peak search and tracking:
+
+  Peaks are searched in the smoothed second difference of the
+  spectrum (smooth passes of the 1-2-1 filter, at most 
+  PEAK_MAX_SMOOTH, more passes find broader and weaker peaks;
+  both applied as one vectorised convolution).
+  A peak is a minimum of the second difference more than thresh
+  standard deviations below zero. Between searches each tracked
+  peak is re-evaluated around its centroid on every readout, 
+  which costs a few channels per peak; the spectrum is searched
+  again once the counts since the last search reach rescan times
+  the counts at that search (e.g. 0.1), or after a clear.
+  Attached to a detector (libdbase_set_peaks()) it is updated by
+  every libdbase_get_spectrum(). Not freed by libdbase_close().
+*/
+#define PEAK_MAX        64         /* max tracked peaks */
+#define PEAK_MAX_SMOOTH 8          /* max smoothing passes */
+spec_peaks *libdbase_peaks_new(double thresh, int smooth, double rescan);
+void libdbase_peaks_free(spec_peaks *pk);
+  /* Attach pk to det, NULL removes it */
+int libdbase_set_peaks(detector *det, spec_peaks *pk);
+  /* 
+     New readout: spectrum and diff spectrum (DBASE_LEN+1 channels),
+     returns 1 if the spectrum was searched, 0 if the peaks were 
+     only updated, <0 on error
+  */
+int libdbase_peaks_update(spec_peaks *pk, const int32_t *spec, const int32_t *diff);
+  /* Search spec now, returns the number of peaks */
+int libdbase_peaks_scan(spec_peaks *pk, const int32_t *spec);
+  /* Copy up to len peaks (by channel) to out, returns number copied */
+int libdbase_peaks_get(const spec_peaks *pk, peak_info *out, int len);
+
+/*
+  ROI registry:
+
+  ROIs lo..hi (inclusive channels) with bg background channels on
+  each side (0: no background) are registered once. The registry
+  keeps prefix sums of the spectrum, so each ROI costs O(1).
+  Attached to a detector (libdbase_set_rois()) the prefix sums are
+  refreshed from det->spec by every libdbase_get_spectrum(),
+  otherwise with libdbase_roi_update().
+  The registry is not freed by libdbase_close().
+*/
+roi_set *libdbase_roi_new(void);
+void libdbase_roi_free(roi_set *rs);
+  /* Register ROI, returns its index or <0 on error */
+int libdbase_roi_add(roi_set *rs, uint lo, uint hi, uint bg);
+  /* Number of registered ROIs */
+int libdbase_roi_count(const roi_set *rs);
+  /* Attach rs to det, NULL removes it */
+int libdbase_set_rois(detector *det, roi_set *rs);
+  /* Refresh prefix sums from spectrum (DBASE_LEN+1 channels) */
+int libdbase_roi_update(roi_set *rs, const int32_t *spec);
+  /* Counts in channels lo..hi (inclusive), any ROI */
+int64_t libdbase_roi_sum(const roi_set *rs, uint lo, uint hi);
+  /* Evaluate ROI idx */
+int libdbase_roi_eval(const roi_set *rs, int idx, roi_result *res);
+  /* Evaluate the first len registered ROIs, returns number evaluated */
+int libdbase_roi_eval_all(const roi_set *rs, roi_result *res, int len);
+
+/*
+  Spectrum store:
+
+  Append-only time series of spec_records in a memory-mapped
+  file (host byte order), grown in extents of STORE_EXTENT 
+  records, with the record times in a mapped index file 
+  (path.idx). Times are kept non-decreasing, so "the spectrum
+  at time t" and time ranges are binary searches and records
+  are read in place, without parsing. Record pointers are valid
+  until the next append or close. The index is rebuilt from the
+  records if it is behind (e.g. after a crash).
+
+  Open path for reading (rw = 0) or appending (rw = 1, created
+  if missing), returns NULL on failure.
+*/
+spec_store *libdbase_store_open(const char *path, int rw);
+  /* Close (the file is truncated to its records) */
+int libdbase_store_close(spec_store *st);
+  /* Append det's spectrum and status, timed now */
+int libdbase_store_append(spec_store *st, const detector *det);
+  /* Append a record at time (us), status can be NULL */
+int libdbase_store_append_spec(spec_store *st, uint64_t time, 
+			       const status_msg *status, const int32_t *spec);
+  /* Flush the mappings to disk */
+int libdbase_store_sync(spec_store *st);
+  /* Number of records */
+uint64_t libdbase_store_count(const spec_store *st);
+  /* Record idx, NULL if out of range */
+const spec_record *libdbase_store_get(const spec_store *st, uint64_t idx);
+  /* Index of the last record with time <= time, -1 if none */
+int64_t libdbase_store_find(const spec_store *st, uint64_t time);
+  /* 
+     Records with t0 <= time < t1: index of the first through
+     *first, returns their number
+  */
+uint64_t libdbase_store_range(const spec_store *st, uint64_t t0, uint64_t t1, uint64_t *first);
+
 /*
   Write libdbase's detector-specific directory
   into path buffer (without trailing '/').
@@ -0,0 +1,149 @@
+/*
+ * libdbaserh.hpp: C++ list-mode views for libdbaserh (header only)
+ *
+ * Lazy views over raw list mode words (as read by
+ * libdbase_read_lm_words()): the words are decoded to pulses
+ * on dereference, so filter/count/histogram pipelines never
+ * build a pulse array.
+ *
+ *   uint32_t words[LM_FIFO_WORDS]; int n;
+ *   libdbase_read_lm_words(det, words, LM_FIFO_WORDS, &n);
+ *   libdbase::lm_words_view v(words, n, time);
+ *   for(pulse p : v | std::views::filter(in_peak)) ...
+ *   time = v.end_time();
+ *
+ * The ranges (std::views) need C++20, range-for C++17.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __LIBDBASERH_HPP__
+#define __LIBDBASERH_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
+
+#include "libdbaserh.h"
+
+namespace libdbase {
+
+  /*
+    List mode word format (see libdbaserhi.h)
+  */
+  const uint32_t lm_ts_flag = 0x80000000u;  /* time word */
+  const uint32_t lm_ts_mask = 0x7fffffffu;  /* time word: time */
+  const uint32_t lm_t_mask  = 0x001fffffu;  /* event: time since time word */
+  const uint32_t lm_a_mask  = 0x7fe00000u;  /* event: amplitude */
+  const uint32_t lm_max_t   = 1048575u;     /* timer rollover */
+
+  /* Decode event word w after time word ts */
+  inline pulse lm_decode(uint32_t w, uint32_t ts){
+    pulse p;
+    uint32_t t = w & lm_t_mask;
+    p.amp = (w & lm_a_mask) >> 21;
+    p.time = (t > lm_max_t ? t - lm_max_t : t) + ts;
+    return p;
+  }
+
+  /* End of a view: end of buffer or a zero word */
+  struct lm_end {};
+
+  /*
+    Iterator over the events, time words are consumed on
+    increment and kept as state, so the iterator is a couple
+    of pointers and the last time.
+  */
+  class lm_iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef pulse value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const pulse *pointer;
+    typedef pulse reference;
+
+    lm_iterator() : p_(nullptr), e_(nullptr), ts_(0) {}
+    lm_iterator(const uint32_t *p, const uint32_t *e, uint32_t ts)
+      : p_(p), e_(e), ts_(ts) { skip(); }
+
+    pulse operator*() const { return lm_decode(*p_, ts_); }
+    /* Raw word and time word, without decoding */
+    uint32_t word() const { return *p_; }
+    uint32_t time_word() const { return ts_; }
+
+    lm_iterator &operator++() { ++p_; skip(); return *this; }
+    lm_iterator operator++(int) { lm_iterator t = *this; ++*this; return t; }
+
+    bool operator==(const lm_iterator &o) const { return p_ == o.p_; }
+    bool operator!=(const lm_iterator &o) const { return p_ != o.p_; }
+    friend bool operator==(const lm_iterator &i, lm_end) { return i.done(); }
+    friend bool operator!=(const lm_iterator &i, lm_end) { return !i.done(); }
+#if __cplusplus < 202002L
+    friend bool operator==(lm_end, const lm_iterator &i) { return i.done(); }
+    friend bool operator!=(lm_end, const lm_iterator &i) { return !i.done(); }
+#endif
+
+  private:
+    bool done() const { return p_ == e_; }
+    /* Consume time words, stop at an event or the end */
+    void skip(){
+      while(p_ != e_ && (*p_ & lm_ts_flag)){
+	ts_ = *p_ & lm_ts_mask;
+	++p_;
+      }
+      if(p_ != e_ && *p_ == 0)
+	p_ = e_;
+    }
+    const uint32_t *p_, *e_;
+    uint32_t ts_;
+  };
+
+  /*
+    View over n raw words, time is the last time word before
+    them (the *time of libdbase_read_lm_packets()). The view does
+    not own the words.
+  */
+  class lm_words_view
+#if __cplusplus >= 202002L
+    : public std::ranges::view_interface<lm_words_view>
+#endif
+  {
+  public:
+    lm_words_view() : w_(nullptr), n_(0), time_(0) {}
+    lm_words_view(const uint32_t *words, int n, uint32_t time = 0)
+      : w_(words), n_(n > 0 ? n : 0), time_(time) {}
+
+    lm_iterator begin() const { return lm_iterator(w_, w_ + n_, time_); }
+    lm_end end() const { return lm_end(); }
+
+    /* Last time word of the view, to start the next one with */
+    uint32_t end_time() const {
+      uint32_t t = time_;
+      for(int k = 0; k < n_ && w_[k] != 0; k++)
+	if(w_[k] & lm_ts_flag)
+	  t = w_[k] & lm_ts_mask;
+      return t;
+    }
+
+  private:
+    const uint32_t *w_;
+    int n_;
+    uint32_t time_;
+  };
+
+} /* namespace libdbase */
+
+#endif /* end of __LIBDBASERH_HPP__ */
@@ -0,0 +1,756 @@
+/*
+ * libdbaserhan.c: List-mode analysis for libdbaserh
+ * 
+ * Multi-detector coincidence engine, device to host
+ * clock model, neutron noise (Rossi-alpha, Feynman-Y) and
+ * inter-arrival times with dead time estimates.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>     /* error codes */
+#include <math.h>      /* exp() */
+#include <stdio.h>     /* printf(), fprintf(), ... */
+#include <stdlib.h>    /* malloc(), calloc(), free(), ... */
+#include <string.h>    /* memcpy() */
+#include <time.h>      /* clock_gettime() */
+
+/* libdbase non-public header */
+#include "libdbaserhi.h"
+
+/*
+  Coincidence engine
+*/
+lm_coinc *libdbase_lm_coinc_new(int ndet, uint64_t window, int mult){
+  if(ndet <= 0 || ndet > LM_COINC_MAX || mult < 1){
+    fprintf(stderr, "E: libdbase_lm_coinc_new(), ndet must be 1-%d and mult positive\n",
+	    LM_COINC_MAX);
+    return NULL;
+  }
+  int k;
+  lm_coinc *c = (lm_coinc *) calloc(1, sizeof(lm_coinc));
+  if(c == NULL){
+    fprintf(stderr, "E: libdbase_lm_coinc_new() unable to allocate memory\n");
+    return NULL;
+  }
+  c->d = (lm_coinc_det *) calloc(ndet, sizeof(lm_coinc_det));
+  if(c->d == NULL){
+    fprintf(stderr, "E: libdbase_lm_coinc_new() unable to allocate memory\n");
+    free(c);
+    return NULL;
+  }
+  c->ndet = ndet;
+  for(k = 0; k < ndet; k++){
+    c->d[k].ev = (lm_event *) malloc(LM_COINC_QUEUE * sizeof(lm_event));
+    if(c->d[k].ev == NULL){
+      fprintf(stderr, "E: libdbase_lm_coinc_new() unable to allocate memory\n");
+      libdbase_lm_coinc_free(c);
+      return NULL;
+    }
+  }
+  c->window = window;
+  c->mult = mult;
+  return c;
+}
+
+void libdbase_lm_coinc_free(lm_coinc *c){
+  if(c == NULL)
+    return;
+  int k;
+  for(k = 0; k < c->ndet; k++)
+    free(c->d[k].ev);
+  free(c->d);
+  free(c->out);
+  free(c);
+}
+
+int libdbase_lm_coinc_offset(lm_coinc *c, int d, int64_t offset){
+  if(c == NULL || d < 0 || d >= c->ndet){
+    fprintf(stderr, "E: libdbase_lm_coinc_offset(), invalid engine or detector\n");
+    return -1;
+  }
+  c->d[d].offset = offset;
+  return 0;
+}
+
+int libdbase_lm_coinc_veto(lm_coinc *c, uint32_t mask){
+  if(c == NULL){
+    fprintf(stderr, "E: libdbase_lm_coinc_veto(), engine was NULL\n");
+    return -1;
+  }
+  c->veto = mask;
+  return 0;
+}
+
+uint64_t dbase_coinc_time(lm_coinc_det *d, uint32_t t){
+  uint64_t u = dbase_lm_unwrap(&d->epoch, &d->last, &d->have_last, t);
+  if(d->offset < 0 && u < (uint64_t) -d->offset)
+    return 0ULL;
+  return u + d->offset;
+}
+
+/*
+  Push pulses into the reorder buffer of detector d.
+  Pulses are nearly time ordered, so each is inserted by
+  moving it back from the tail.
+*/
+int libdbase_lm_coinc_push(lm_coinc *c, int d, const pulse *p, int n, uint32_t time){
+  if(c == NULL || d < 0 || d >= c->ndet || (p == NULL && n > 0)){
+    fprintf(stderr, "E: libdbase_lm_coinc_push(), invalid engine, detector or pulses\n");
+    return -1;
+  }
+  lm_coinc_det *q = &c->d[d];
+  const int mask = LM_COINC_QUEUE - 1;
+  int k, i, j;
+  lm_event e;
+  uint64_t r;
+  for(k = 0; k < n; k++){
+    /* Full, merge the oldest events early */
+    if(q->n == LM_COINC_QUEUE){
+      uint64_t upto = q->ev[q->head].time + 1;
+      c->forced++;
+      if(dbase_coinc_merge(c, upto, 0) < 0)
+	return -ENOMEM;
+    }
+    e.time = dbase_coinc_time(q, p[k].time);
+    e.amp = p[k].amp;
+    e.det = (uint32_t) d;
+    i = (q->head + q->n) & mask;
+    q->n++;
+    for(j = q->n - 1; j > 0 && q->ev[(i - 1) & mask].time > e.time; j--){
+      q->ev[i] = q->ev[(i - 1) & mask];
+      i = (i - 1) & mask;
+    }
+    q->ev[i] = e;
+  }
+  /* The time word, only forward */
+  r = dbase_coinc_time(q, time);
+  if(r > q->reached)
+    q->reached = r;
+  /* All detectors have reached 'upto', events before it are final */
+  uint64_t upto = c->d[0].reached;
+  for(k = 1; k < c->ndet; k++)
+    if(c->d[k].reached < upto)
+      upto = c->d[k].reached;
+  return dbase_coinc_merge(c, upto, 0);
+}
+
+/*
+  k-way merge of the detector buffers: take the earliest head
+  (linear scan, ndet is small) while it is before 'upto', and 
+  group it. With 'all' set the open group may be closed too.
+*/
+int dbase_coinc_merge(lm_coinc *c, uint64_t upto, int all){
+  const int mask = LM_COINC_QUEUE - 1;
+  int k, m;
+  lm_event *e;
+  for(;;){
+    m = -1;
+    for(k = 0; k < c->ndet; k++)
+      if(c->d[k].n > 0 && (m < 0 || c->d[k].ev[c->d[k].head].time < 
+			   c->d[m].ev[c->d[m].head].time))
+	m = k;
+    if(m < 0 || c->d[m].ev[c->d[m].head].time >= upto)
+      break;
+    e = &c->d[m].ev[c->d[m].head];
+    /* Outside the open group's window? */
+    if(c->cur.n > 0 && e->time - c->cur.time > c->window)
+      if(dbase_coinc_close(c) < 0)
+	return -ENOMEM;
+    if(c->cur.n == 0)
+      c->cur.time = e->time;
+    if(c->cur.n < LM_COINC_MAX)
+      c->cur.ev[c->cur.n++] = *e;
+    else
+      c->dropped++;
+    c->cur.mask |= 1u << e->det;
+    c->d[m].head = (c->d[m].head + 1) & mask;
+    c->d[m].n--;
+  }
+  /* Nothing more can join the open group */
+  if(c->cur.n > 0 && (all || upto > c->cur.time + c->window))
+    return dbase_coinc_close(c);
+  return 0;
+}
+
+/* Number of set bits */
+static int dbase_bits(uint32_t x){
+  int n = 0;
+  for(; x; x &= x - 1)
+    n++;
+  return n;
+}
+
+int dbase_coinc_close(lm_coinc *c){
+  lm_group *g = &c->cur;
+  int k, j;
+  if(c->veto != 0){
+    if(g->mask & c->veto){
+      g->n = 0;
+      g->mask = 0;
+      return 0;
+    }
+  }
+  if(dbase_bits(g->mask) >= c->mult){
+    /* Grow output ring */
+    if(c->on == c->ocap){
+      int cap = c->ocap == 0 ? 64 : 2 * c->ocap;
+      lm_group *tmp = (lm_group *) malloc(cap * sizeof(lm_group));
+      if(tmp == NULL){
+	fprintf(stderr, "E: dbase_coinc_close() unable to allocate memory\n");
+	return -ENOMEM;
+      }
+      for(k = 0; k < c->on; k++)
+	tmp[k] = c->out[(c->ohead + k) % c->ocap];
+      free(c->out);
+      c->out = tmp;
+      c->ocap = cap;
+      c->ohead = 0;
+    }
+    lm_group *o = &c->out[(c->ohead + c->on) % c->ocap];
+    o->time = g->time;
+    o->mask = g->mask;
+    o->n = g->n;
+    for(j = 0; j < g->n; j++)
+      o->ev[j] = g->ev[j];
+    c->on++;
+  }
+  g->n = 0;
+  g->mask = 0;
+  return 0;
+}
+
+int libdbase_lm_coinc_get(lm_coinc *c, lm_group *g, int len){
+  if(c == NULL || g == NULL){
+    fprintf(stderr, "E: libdbase_lm_coinc_get(), engine or groups was NULL\n");
+    return -1;
+  }
+  int k = 0;
+  while(k < len && c->on > 0){
+    g[k++] = c->out[c->ohead];
+    c->ohead = (c->ohead + 1) % c->ocap;
+    c->on--;
+  }
+  return k;
+}
+
+int libdbase_lm_coinc_finish(lm_coinc *c){
+  if(c == NULL){
+    fprintf(stderr, "E: libdbase_lm_coinc_finish(), engine was NULL\n");
+    return -1;
+  }
+  return dbase_coinc_merge(c, UINT64_MAX, 1);
+}
+
+/*
+  Clock model
+*/
+lm_clock *libdbase_lm_clock_new(uint32_t id, uint64_t span){
+  if(span == 0ULL){
+    fprintf(stderr, "E: libdbase_lm_clock_new(), span must be positive\n");
+    return NULL;
+  }
+  lm_clock *clk = (lm_clock *) calloc(1, sizeof(lm_clock));
+  if(clk == NULL){
+    fprintf(stderr, "E: libdbase_lm_clock_new() unable to allocate memory\n");
+    return NULL;
+  }
+  clk->id = id;
+  clk->span = span;
+  clk->b = 1.0;
+  return clk;
+}
+
+void libdbase_lm_clock_free(lm_clock *clk){
+  free(clk);
+}
+
+uint64_t libdbase_host_time_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+/*
+  Weighted least squares with forgetting: the sums are scaled 
+  by span/(span + dt) for dt us of device time since the last 
+  sample, then the new sample is added with weight 1.
+  Times are relative to the first sample, so doubles keep 
+  sub-us precision for years.
+*/
+int libdbase_lm_clock_sample(lm_clock *clk, uint64_t device, uint64_t host){
+  if(clk == NULL){
+    fprintf(stderr, "E: libdbase_lm_clock_sample(), clock was NULL\n");
+    return -1;
+  }
+  double x, y, f, d;
+  if(clk->samples == 0){
+    clk->x0 = device;
+    clk->y0 = host;
+  }
+  else if(device > clk->last_x){
+    f = (double) clk->span / (double) (clk->span + (device - clk->last_x));
+    clk->sw *= f;
+    clk->sx *= f;
+    clk->sy *= f;
+    clk->sxx *= f;
+    clk->sxy *= f;
+  }
+  x = (double) device - (double) clk->x0;
+  y = (double) host - (double) clk->y0;
+  clk->sw += 1.0;
+  clk->sx += x;
+  clk->sy += y;
+  clk->sxx += x * x;
+  clk->sxy += x * y;
+  clk->last_x = device;
+  clk->samples++;
+
+  /* Refit */
+  d = clk->sw * clk->sxx - clk->sx * clk->sx;
+  if(clk->samples >= 2 && d > 0.0){
+    clk->b = (clk->sw * clk->sxy - clk->sx * clk->sy) / d;
+    clk->a = (clk->sy - clk->b * clk->sx) / clk->sw;
+  }
+  else{
+    /* Offset only */
+    clk->a = clk->sy / clk->sw - clk->sx / clk->sw;
+    clk->b = 1.0;
+  }
+  return 0;
+}
+
+uint64_t libdbase_lm_clock_host(const lm_clock *clk, uint64_t device){
+  if(clk == NULL || clk->samples == 0)
+    return device;
+  double h = (double) clk->y0 + clk->a + 
+    clk->b * ((double) device - (double) clk->x0);
+  return h < 0.0 ? 0ULL : (uint64_t) (h + 0.5);
+}
+
+int libdbase_lm_clock_info(const lm_clock *clk, double *ppm, uint64_t *samples){
+  if(clk == NULL){
+    fprintf(stderr, "E: libdbase_lm_clock_info(), clock was NULL\n");
+    return -1;
+  }
+  if(ppm != NULL)
+    *ppm = (clk->b - 1.0) * 1e6;
+  if(samples != NULL)
+    *samples = clk->samples;
+  return clk->samples >= 2 ? 0 : 1;
+}
+
+/*
+  Read events in host time.
+  The model is fixed within a readout, so each event costs one 
+  multiply-add: host = base + b * (device time - ts), with base 
+  the host time of the last time word ts.
+*/
+int libdbase_read_lm_events(detector *det, lm_clock *clk, lm_event *buf, 
+			    int len, int *read){
+  if(clk == NULL || buf == NULL || read == NULL || len <= 0){
+    fprintf(stderr, "E: libdbase_read_lm_events(), invalid clock, buffer or length\n");
+    return -1;
+  }
+  int err, n, k, r = 0;
+  uint32_t off;
+  uint64_t host, ts = 0ULL;
+  *read = 0;
+  uint32_t *tmp = malloc(len * sizeof(uint32_t));
+  if(tmp == NULL){
+    fprintf(stderr, "E: failed to allocate temporary buffer in libdbase_read_lm_events()\n");
+    return -ENOMEM;
+  }
+  err = libdbase_read_lm_words(det, tmp, len, &n);
+  host = libdbase_host_time_us();
+  if(err < 0){
+    free(tmp);
+    return err;
+  }
+
+  /* 
+     Latest device time of this readout (last event or time word)
+     is the new sample. The last time word alone would be up to
+     TS_STEP us older than the transfer.
+  */
+  {
+    uint64_t e = clk->epoch, t = clk->ts, d = 0ULL;
+    uint32_t l = clk->last;
+    int h = clk->have_last, seen = 0;
+    for(k = 0; k < n; k++){
+      if(tmp[k] > TS_MASK){
+	t = dbase_lm_unwrap(&e, &l, &h, tmp[k] & TS_MASK);
+	off = 0;
+      }
+      /* Events before the first time word have no time */
+      else if(h){
+	off = tmp[k] & T_MASK;
+	off -= (off > MAX_T) ? MAX_T : 0;
+      }
+      else
+	continue;
+      if(t + off > d)
+	d = t + off;
+      seen = 1;
+    }
+    if(seen)
+      libdbase_lm_clock_sample(clk, d, host);
+  }
+
+  double b = clk->b, base = 0.0;
+  ts = clk->ts;
+  base = (double) libdbase_lm_clock_host(clk, ts);
+  for(k = 0; k < n; k++){
+    if(tmp[k] > TS_MASK){
+      ts = dbase_lm_unwrap(&clk->epoch, &clk->last, &clk->have_last, 
+			   tmp[k] & TS_MASK);
+      base = (double) libdbase_lm_clock_host(clk, ts);
+      continue;
+    }
+    off = tmp[k] & T_MASK;
+    off -= (off > MAX_T) ? MAX_T : 0;
+    buf[r].time = (uint64_t) (base + b * off + 0.5);
+    buf[r].amp = (tmp[k] & A_MASK) >> 21;
+    buf[r].det = clk->id;
+    r++;
+  }
+  clk->ts = ts;
+  *read = r;
+  free(tmp);
+  return 0;
+}
+
+/*
+  Rossi-alpha
+*/
+lm_rossi *libdbase_lm_rossi_new(uint64_t width, int nbins){
+  if(width == 0ULL || nbins <= 0){
+    fprintf(stderr, "E: libdbase_lm_rossi_new(), width and nbins must be positive\n");
+    return NULL;
+  }
+  lm_rossi *r = (lm_rossi *) calloc(1, sizeof(lm_rossi));
+  if(r == NULL){
+    fprintf(stderr, "E: libdbase_lm_rossi_new() unable to allocate memory\n");
+    return NULL;
+  }
+  r->hist = (uint64_t *) calloc(nbins, sizeof(uint64_t));
+  r->ring = (uint64_t *) malloc(LM_ROSSI_RING * sizeof(uint64_t));
+  if(r->hist == NULL || r->ring == NULL){
+    fprintf(stderr, "E: libdbase_lm_rossi_new() unable to allocate memory\n");
+    libdbase_lm_rossi_free(r);
+    return NULL;
+  }
+  r->width = width;
+  r->nbins = nbins;
+  r->window = width * nbins;
+  return r;
+}
+
+void libdbase_lm_rossi_free(lm_rossi *r){
+  if(r == NULL)
+    return;
+  free(r->hist);
+  free(r->ring);
+  free(r);
+}
+
+/*
+  Each event closes the window for the oldest events, then 
+  it is paired with all events left in the ring
+*/
+int libdbase_lm_rossi_feed(lm_rossi *r, const pulse *p, int n){
+  if(r == NULL || (p == NULL && n > 0)){
+    fprintf(stderr, "E: libdbase_lm_rossi_feed(), r or p was NULL\n");
+    return -1;
+  }
+  const int mask = LM_ROSSI_RING - 1;
+  int k, j;
+  uint64_t t, d;
+  for(k = 0; k < n; k++){
+    t = dbase_lm_unwrap(&r->epoch, &r->last, &r->have_last, p[k].time);
+    while(r->n > 0 && t >= r->ring[r->head] + r->window){
+      r->head = (r->head + 1) & mask;
+      r->n--;
+    }
+    for(j = 0; j < r->n; j++){
+      d = t - r->ring[(r->head + j) & mask];
+      /* Out of order events are not paired backwards */
+      if(d < r->window)
+	r->hist[d / r->width]++;
+    }
+    if(r->n == LM_ROSSI_RING){
+      r->head = (r->head + 1) & mask;
+      r->n--;
+      r->overflow++;
+    }
+    r->ring[(r->head + r->n) & mask] = t;
+    r->n++;
+  }
+  return 0;
+}
+
+int libdbase_lm_rossi_get(const lm_rossi *r, uint64_t *hist, int len){
+  if(r == NULL || hist == NULL){
+    fprintf(stderr, "E: libdbase_lm_rossi_get(), r or hist was NULL\n");
+    return -1;
+  }
+  if(len > r->nbins)
+    len = r->nbins;
+  memcpy(hist, r->hist, len * sizeof(uint64_t));
+  return len;
+}
+
+/*
+  Feynman-Y
+*/
+lm_feynman *libdbase_lm_feynman_new(uint64_t gate, int ngates){
+  if(gate == 0ULL || ngates <= 0){
+    fprintf(stderr, "E: libdbase_lm_feynman_new(), gate and ngates must be positive\n");
+    return NULL;
+  }
+  lm_feynman *f = (lm_feynman *) calloc(1, sizeof(lm_feynman));
+  if(f == NULL){
+    fprintf(stderr, "E: libdbase_lm_feynman_new() unable to allocate memory\n");
+    return NULL;
+  }
+  f->w = (lm_feynman_width *) calloc(ngates, sizeof(lm_feynman_width));
+  if(f->w == NULL){
+    fprintf(stderr, "E: libdbase_lm_feynman_new() unable to allocate memory\n");
+    free(f);
+    return NULL;
+  }
+  f->gate = gate;
+  f->ngates = ngates;
+  return f;
+}
+
+void libdbase_lm_feynman_free(lm_feynman *f){
+  if(f == NULL)
+    return;
+  free(f->w);
+  free(f);
+}
+
+/* Close the open base gate, and the wider gates ending with it */
+static void dbase_feynman_close(lm_feynman *f){
+  int k;
+  lm_feynman_width *w;
+  f->closed++;
+  for(k = 0; k < f->ngates; k++){
+    w = &f->w[k];
+    w->cnt += f->cnt;
+    if(f->closed % (uint64_t) (k + 1) == 0){
+      w->s1 += (double) w->cnt;
+      w->s2 += (double) w->cnt * (double) w->cnt;
+      w->gates++;
+      w->cnt = 0;
+    }
+  }
+  f->cnt = 0;
+  f->cur++;
+}
+
+int libdbase_lm_feynman_feed(lm_feynman *f, const pulse *p, int n){
+  if(f == NULL || (p == NULL && n > 0)){
+    fprintf(stderr, "E: libdbase_lm_feynman_feed(), f or p was NULL\n");
+    return -1;
+  }
+  int k;
+  uint64_t g;
+  for(k = 0; k < n; k++){
+    g = dbase_lm_unwrap(&f->epoch, &f->last, &f->have_last, p[k].time) / f->gate;
+    if(!f->started){
+      f->cur = g;
+      f->started = 1;
+    }
+    /* Close gates up to this one (late events count in the open gate) */
+    while(f->cur < g)
+      dbase_feynman_close(f);
+    f->cnt++;
+  }
+  return 0;
+}
+
+int libdbase_lm_feynman_y(const lm_feynman *f, double *y, double *mean, int len){
+  if(f == NULL || y == NULL){
+    fprintf(stderr, "E: libdbase_lm_feynman_y(), f or y was NULL\n");
+    return -1;
+  }
+  int k;
+  double m, v;
+  if(len > f->ngates)
+    len = f->ngates;
+  for(k = 0; k < len; k++){
+    const lm_feynman_width *w = &f->w[k];
+    m = w->gates > 0 ? w->s1 / w->gates : 0.0;
+    v = w->gates > 0 ? w->s2 / w->gates - m * m : 0.0;
+    y[k] = m > 0.0 ? v / m - 1.0 : 0.0;
+    if(mean != NULL)
+      mean[k] = m;
+  }
+  return len;
+}
+
+/*
+  Inter-arrival times
+*/
+lm_iat *libdbase_lm_iat_new(uint64_t tail){
+  lm_iat *iat = (lm_iat *) calloc(1, sizeof(lm_iat));
+  if(iat == NULL){
+    fprintf(stderr, "E: libdbase_lm_iat_new() unable to allocate memory\n");
+    return NULL;
+  }
+  iat->tail = tail;
+  return iat;
+}
+
+void libdbase_lm_iat_free(lm_iat *iat){
+  free(iat);
+}
+
+int libdbase_set_lm_iat(detector *det, lm_iat *iat){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_lm_iat(), detector was NULL\n");
+    return -1;
+  }
+  det->lmi = iat;
+  return 0;
+}
+
+/*
+  Bins 0-15 are 1 us wide, then 8 bins per octave 
+  (exponent and the 3 bits below the leading one)
+*/
+int dbase_iat_bin(uint64_t dt){
+  if(dt < 16)
+    return (int) dt;
+  int e = 63 - __builtin_clzll(dt);
+  int b = (e - 2) * 8 + (int) ((dt >> (e - 3)) & 7);
+  return b < LM_IAT_BINS ? b : LM_IAT_BINS - 1;
+}
+
+uint64_t libdbase_lm_iat_edge(int k){
+  if(k < 16)
+    return (uint64_t) (k < 0 ? 0 : k);
+  return (uint64_t) (8 + k % 8) << (k / 8 - 1);
+}
+
+int libdbase_lm_iat_feed(lm_iat *iat, const uint32_t *words, int n){
+  if(iat == NULL || (words == NULL && n > 0)){
+    fprintf(stderr, "E: libdbase_lm_iat_feed(), iat or words was NULL\n");
+    return -1;
+  }
+  int k, had;
+  uint32_t off;
+  uint64_t t, dt, epoch;
+  for(k = 0; k < n; k++){
+    if(words[k] == 0)
+      break;
+    if(words[k] > TS_MASK){
+      had = iat->have_last;
+      epoch = iat->epoch;
+      t = dbase_lm_unwrap(&iat->epoch, &iat->last, &iat->have_last,
+			  words[k] & TS_MASK);
+      /* 
+	 Rollover or missing time words (lost data): the next 
+	 interval is not trusted, start again from the next event
+      */
+      if(had && (iat->epoch != epoch || t > iat->ts + TS_STEP))
+	iat->chain = 0;
+      iat->ts = t;
+      continue;
+    }
+    /* No time word yet, the event can't be timed */
+    if(!iat->have_last)
+      continue;
+    off = words[k] & T_MASK;
+    off -= (off > MAX_T) ? MAX_T : 0;
+    t = iat->ts + off;
+    iat->events++;
+    if(!iat->chain){
+      iat->prev = t;
+      iat->chain = 1;
+      continue;
+    }
+    /* Out of order events give no interval */
+    if(t < iat->prev)
+      continue;
+    dt = t - iat->prev;
+    iat->hist[dbase_iat_bin(dt)]++;
+    if(dt >= iat->tail){
+      iat->n_tail++;
+      iat->s_tail += dt - iat->tail;
+    }
+    iat->intervals++;
+    iat->span += dt;
+    iat->prev = t;
+  }
+  return 0;
+}
+
+int libdbase_lm_iat_hist(const lm_iat *iat, uint64_t *hist, int len){
+  if(iat == NULL || hist == NULL){
+    fprintf(stderr, "E: libdbase_lm_iat_hist(), iat or hist was NULL\n");
+    return -1;
+  }
+  if(len > LM_IAT_BINS)
+    len = LM_IAT_BINS;
+  memcpy(hist, iat->hist, len * sizeof(uint64_t));
+  return len;
+}
+
+/*
+  Intervals are exponential beyond the tail start (memoryless),
+  so the true rate is n_tail / s_tail. Times are whole us, which
+  shortens the tail intervals by 0.5 us on average.
+  The measured rate is the number of intervals over their sum, so
+  the time skipped at a rollover or after lost data is left out.
+*/
+int libdbase_lm_iat_estimate(const lm_iat *iat, const detector *det, lm_deadtime *est){
+  if(iat == NULL || est == NULL){
+    fprintf(stderr, "E: libdbase_lm_iat_estimate(), iat or est was NULL\n");
+    return -1;
+  }
+  memset(est, 0, sizeof(lm_deadtime));
+  est->events = iat->events;
+  est->lt_dead = -1.0;
+  if(det != NULL && det->status.RT > 0)
+    est->lt_dead = 1.0 - (double) det->status.LT / (double) det->status.RT;
+  if(iat->intervals == 0 || iat->span == 0 || iat->s_tail == 0)
+    return 1;
+  double m = (double) iat->intervals / (double) iat->span;
+  double r = (double) iat->n_tail / ((double) iat->s_tail + 0.5 * iat->n_tail);
+  est->rate = m * 1e6;
+  est->true_rate = r * 1e6;
+  if(r > m){
+    est->dead = 1.0 - m / r;
+    est->tau = 1.0 / m - 1.0 / r;
+    est->pileup = 1.0 - exp(-r * est->tau);
+  }
+  return 0;
+}
+
+void libdbase_print_lm_deadtime(const lm_iat *iat, const detector *det, FILE *fh){
+  lm_deadtime est;
+  if(fh == NULL)
+    fh = stdout;
+  if(libdbase_lm_iat_estimate(iat, det, &est) < 0)
+    return;
+  fprintf(fh, "Events            : %llu\n", (unsigned long long) est.events);
+  fprintf(fh, "Measured rate     : %.1f 1/s\n", est.rate);
+  fprintf(fh, "True rate (tail)  : %.1f 1/s\n", est.true_rate);
+  fprintf(fh, "Dead time         : %.2f %% (%.2f us/event)\n", 100.0 * est.dead, est.tau);
+  fprintf(fh, "Pile-up prob.     : %.2f %%\n", 100.0 * est.pileup);
+  if(est.lt_dead >= 0.0)
+    fprintf(fh, "Dead time (LT/RT) : %.2f %%\n", 100.0 * est.lt_dead);
+}
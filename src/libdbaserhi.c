@@ -416,7 +416,7 @@ int dbase_get_spectrum(libusb_device_handle *dev, int32_t *chans, int32_t *last)
   int err, io;
   const int len = (DBASE_LEN + 1);
   const int len_bytes = len * sizeof(int32_t);
-  unsigned char onflag = 1;
+  unsigned char onflag;
   
   /* Temporary buffer */
   int32_t tmp[ len ];
@@ -440,21 +440,7 @@ int dbase_get_spectrum(libusb_device_handle *dev, int32_t *chans, int32_t *last)
   }
   
   /* Read ok; parse int32, calc changes since last spectrum and update spectrum */
-  for(io=0; io < len; io++){
-    /* Check for first msmt after clear */
-    if(onflag){
-      /* spec = all zeros; first measurement  */
-      onflag &= (chans[io] == 0);
-    }
-    /*
-      Watch out for byte order
-    */
-    if( IS_BIG_ENDIAN() ){
-      BYTESWAP(tmp[io]);
-    }
-    last[io] = tmp[io] - chans[io];
-    chans[io] = tmp[io];
-  }
+  onflag = (unsigned char) dbase_spectrum_diff(tmp, chans, last, len);
   
   /* If onflag is true, set all diff spectra to zeros */
   if(onflag) {
@@ -465,6 +451,97 @@ int dbase_get_spectrum(libusb_device_handle *dev, int32_t *chans, int32_t *last)
   return err;
 }
 
+/*
+  Spectrum update kernel.
+  Byte order is resolved at compile time where possible, and the
+  zero check, swap and difference run 4 channels at a time with 
+  gcc vector extensions (SSE2/NEON/AltiVec, or split by gcc). 
+  The difference is taken in uint32 so that it wraps like the
+  device counters.
+*/
+#if defined(__GNUC__)
+typedef uint32_t dbase_v4u __attribute__ ((vector_size (16)));
+#endif
+
+int dbase_spectrum_diff(const int32_t *raw, int32_t *chans, int32_t *last, int len){
+  int k = 0;
+  uint32_t nz = 0, r;
+#if defined(__GNUC__) && DBASE_BIG_ENDIAN >= 0
+  dbase_v4u vr, vc, vz = {0, 0, 0, 0};
+  for(; k + 4 <= len; k += 4){
+    memcpy(&vr, raw + k, sizeof(vr));
+    memcpy(&vc, chans + k, sizeof(vc));
+#if DBASE_BIG_ENDIAN
+    vr = (vr >> 24) | ((vr >> 8) & 0xff00) | ((vr << 8) & 0xff0000) | (vr << 24);
+#endif
+    vz |= vc;
+    vc = vr - vc;
+    memcpy(last + k, &vc, sizeof(vc));
+    memcpy(chans + k, &vr, sizeof(vr));
+  }
+  nz = vz[0] | vz[1] | vz[2] | vz[3];
+#endif
+  /* Tail, or no compile time byte order */
+  for(; k < len; k++){
+    r = (uint32_t) raw[k];
+    if(IS_BIG_ENDIAN())
+      BYTESWAP(r);
+    nz |= (uint32_t) chans[k];
+    last[k] = (int32_t) (r - (uint32_t) chans[k]);
+    chans[k] = (int32_t) r;
+  }
+  return nz == 0;
+}
+
+/*
+  Integer to ASCII, two digits per step from a table of
+  the pairs "00".."99". Returns pointer past the last digit.
+*/
+static const char dbase_digits[201] =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
+
+char *dbase_itoa(char *p, int32_t v){
+  uint32_t u = (uint32_t) v;
+  char t[10];
+  int n = 10, k;
+  if(v < 0){
+    *p++ = '-';
+    u = 0u - u;
+  }
+  while(u >= 100){
+    k = (int) (u % 100) * 2;
+    u /= 100;
+    t[--n] = dbase_digits[k + 1];
+    t[--n] = dbase_digits[k];
+  }
+  if(u >= 10){
+    t[--n] = dbase_digits[u * 2 + 1];
+    t[--n] = dbase_digits[u * 2];
+  }
+  else
+    t[--n] = (char) ('0' + u);
+  memcpy(p, t + n, 10 - n);
+  return p + 10 - n;
+}
+
+/*
+  Format spectrum as "c0 c1 ... cN \n" into buf,
+  at most DBASE_SPEC_CHARS(len) bytes
+*/
+int dbase_format_spectrum(const int32_t *spec, int len, char *buf){
+  char *p = buf;
+  int k;
+  for(k = 0; k < len; k++){
+    p = dbase_itoa(p, spec[k]);
+    *p++ = ' ';
+  }
+  *p++ = '\n';
+  return (int) (p - buf);
+}
+
 /*
   Print spectrum to file handle
 */
@@ -484,40 +561,28 @@ void dbase_print_spectrum_file(const int32_t *spec, int len, FILE *fh){
   /* 2012-02-14
      Used to call fprintf 'len' times,
      print to memory string first...
+     Now formatted by hand into a buffer that holds the whole
+     spectrum, and written at once.
   */
-  int k, left, w = 0;
-  /* allocate 1 char per chan (including space) */
-  const int n = 2048;
-  char *buf = (char *) malloc( n );
-  if(buf == NULL){
-    fprintf(stderr, "E: dbase_print_spectrum_file() unable to allocate memory\n");
-    return;
-  }
-  
-  for(k = 0; k < len; k++) {
-    left = n - w;
-    w += snprintf(buf+w, left, "%d ", spec[k]);
-    /* Check for overflows in buffer -> flush to fh */
-    if( left < 10 ) {
-      fprintf(fh, "%s", buf);
-      w = 0; /* reset written to 0 */
+  int w;
+  char stack[DBASE_SPEC_CHARS(DBASE_LEN + 1)];
+  char *buf = stack;
+  if(len > DBASE_LEN + 1){
+    buf = (char *) malloc( DBASE_SPEC_CHARS(len) );
+    if(buf == NULL){
+      fprintf(stderr, "E: dbase_print_spectrum_file() unable to allocate memory\n");
+      return;
     }
   }
-  fprintf(fh, "%s\n", buf);
-
+  w = dbase_format_spectrum(spec, len, buf);
+  if(fwrite(buf, 1, w, fh) != (size_t) w)
+    fprintf(stderr, "E: dbase_print_spectrum_file() when writing spectrum\n");
 
   if(_DEBUG)
-    fprintf(fh, "%d chars since buffer was cleared\n", w);
-  free(buf);
-
-  /* flush stream */
-  if( fflush(fh) < 0 )
-    fprintf(stderr, "E: dbase_print_spectrum_file() when flushing stream\n");
-
-  /* old code
-  for(k=0;k<len;k++)
-     fprintf(fh, "%d ", spec[k]); 
-  fprintf(fh, "\n"); */
+    fprintf(fh, "%d chars in spectrum\n", w);
+  if(buf != stack)
+    free(buf);
+  /* Not flushed, the caller flushes once per readout */
 }
 
 /* 
@@ -543,6 +608,86 @@ void dbase_print_file_spectrum_binary(const int32_t *arr, int len, FILE *fh){
    fprintf(stderr, "E: dbase_print_file_spectrum_binary(): spectrum handle was NULL\n");
 }
 
+/*
+  Spectrum frames, sparse payload is tried first and abandoned
+  once it would not be smaller than the dense one
+*/
+int dbase_encode_spectrum(const int32_t *spec, int len, unsigned char *buf){
+  unsigned char *p = buf + 3;
+  int k, n, dense = 4 * len, last = -1;
+  for(k = 0; k < len; k++){
+    if(spec[k] == 0)
+      continue;
+    /* Room for one more pair (2 * 5 bytes) within the dense size */
+    if(p - buf - 3 > dense - 10)
+      break;
+    p += dbase_put_varint(p, (uint64_t) (k - last - 1));
+    p += dbase_put_varint(p, ((uint32_t) spec[k] << 1) ^ (uint32_t) (spec[k] >> 31));
+    last = k;
+  }
+  n = (int) (p - buf - 3);
+  if(k == len && n < dense){
+    buf[0] = SPEC_FRAME_SPARSE;
+  }
+  else{
+    buf[0] = SPEC_FRAME_DENSE;
+    for(k = 0, n = dense; k < len; k++)
+      dbase_put_le32(buf + 3 + 4 * k, (uint32_t) spec[k]);
+  }
+  /* Length as a two byte varint, DBASE_FRAME_MAX < 2^14 */
+  buf[1] = (unsigned char) (n | 0x80);
+  buf[2] = (unsigned char) (n >> 7);
+  return n + 3;
+}
+
+int dbase_decode_spectrum(const unsigned char *buf, int n, int32_t *spec, int len){
+  uint64_t plen, skip, zz;
+  int h, i, j, k;
+  if(n < 2)
+    return 0;
+  if((h = dbase_get_varint(buf + 1, n - 1, &plen)) < 0)
+    return n - 1 < 10 ? 0 : -1;
+  h++;
+  if(plen > (uint64_t) (n - h))
+    return 0;
+  if(buf[0] == SPEC_FRAME_DENSE){
+    if(plen != 4 * (uint64_t) len)
+      return -1;
+    for(k = 0; k < len; k++)
+      spec[k] = (int32_t) dbase_get_le32(buf + h + 4 * k);
+  }
+  else if(buf[0] == SPEC_FRAME_SPARSE){
+    memset(spec, 0, len * sizeof(int32_t));
+    for(i = h, k = -1; i < h + (int) plen; i += j){
+      if((j = dbase_get_varint(buf + i, h + (int) plen - i, &skip)) < 0)
+	return -1;
+      if(skip >= (uint64_t) len)
+	return -1;
+      k += (int) skip + 1;
+      i += j;
+      if(k >= len || (j = dbase_get_varint(buf + i, h + (int) plen - i, &zz)) < 0)
+	return -1;
+      spec[k] = (int32_t) ((uint32_t) (zz >> 1) ^ -(uint32_t) (zz & 1));
+    }
+  }
+  else
+    return -1;
+  return h + (int) plen;
+}
+
+void dbase_print_spectrum_frame(const int32_t *spec, int len, FILE *fh){
+  if(spec == NULL || fh == NULL || len <= 0 || len > DBASE_LEN + 1){
+    fprintf(stderr, "E: dbase_print_spectrum_frame(), invalid spectrum or stream\n");
+    return;
+  }
+  unsigned char buf[DBASE_FRAME_MAX];
+  int n = dbase_encode_spectrum(spec, len, buf);
+  if(fwrite(buf, 1, n, fh) != (size_t) n)
+    fprintf(stderr, "E: dbase_print_spectrum_frame() when writing frame, errno=%d\n", errno);
+  if(fflush(fh) < 0)
+    fprintf(stderr, "E: dbase_print_spectrum_frame() when flushing stream\n");
+}
+
 /* 
   JK, digibase init-sequence TODO: "clean" the init process
 */
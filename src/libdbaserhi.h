@@ -45,6 +45,12 @@ extern "C" {
    Bit order test 
 */	
 #define IS_BIG_ENDIAN() ((*(char*) &big_endian_test) == 0)
+/* Same, known at compile time (gcc/clang), -1 if unknown */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+#define DBASE_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#else
+#define DBASE_BIG_ENDIAN -1
+#endif
 
 /*
   dbase usb i/o settings 
@@ -108,6 +114,374 @@ extern "C" {
 #define A_MASK          0x7fe00000
 /* dbase internal timer rollover in listmode */
 #define MAX_T           1048575
+/* Period of the list mode time words (us) */
+#define TS_PERIOD       0x80000000ULL
+/* Interval between list mode time words (us) */
+#define TS_STEP         (MAX_T + 1)
+
+/*
+  List-mode archive layout (all fields little endian):
+  file header (LMA_HEAD_LEN bytes)
+    magic[8], version u32, block size u32, serial i32, 
+    reserved u32, host start time u64
+  blocks (LM_ARCHIVE_BLOCK bytes each)
+    magic u32, events u32, first time u64, payload bytes u32, 
+    reserved u32, payload: (zigzag varint dt, varint amp) per event
+  index (written on close)
+    (first time u64, offset u64, events u32, reserved u32) per block
+  trailer (LMA_TAIL_LEN bytes)
+    magic[8], blocks u64, index offset u64
+*/
+#define LM_ARCHIVE_BLOCK 65536
+#define LMA_VERSION      1
+#define LMA_MAGIC        "DBRHLM01"
+#define LMA_IDX_MAGIC    "DBRHIDX1"
+#define LMA_BLK_MAGIC    0x31424d4c  /* "LMB1" */
+#define LMA_HEAD_LEN     32
+#define LMA_BLK_HEAD     24
+#define LMA_IDX_LEN      24
+#define LMA_TAIL_LEN     24
+/* Max encoded size of one event (u64 + u32 varints) */
+#define LMA_MAX_EVENT    15
+/* Min encoded size of one event (two 1-byte varints) */
+#define LMA_MIN_EVENT    2
+
+/* One block index entry */
+typedef struct {
+  uint64_t first;           /* time of first event */
+  uint64_t offset;          /* file offset of block */
+  uint32_t events;          /* events in block */
+} lma_index;
+
+/* List-mode archive (reader or writer) */
+struct lm_archive {
+  FILE *fh;                 /* underlying stream */
+  int write;                /* 1 if opened for writing */
+  int serial;               /* detector serial number */
+  unsigned char *blk;       /* current block */
+  int bsize;                /* block size */
+  int pos;                  /* write/read position in blk */
+  int used;                 /* payload end in blk (reader) */
+  uint32_t events;          /* events in blk */
+  uint32_t left;            /* events left to read in blk */
+  uint64_t first;           /* time of first event in blk */
+  uint64_t prev;            /* time of previous event */
+  uint64_t epoch;           /* unwrap: added to 32-bit times */
+  uint32_t last;            /* unwrap: last 32-bit time */
+  int have_last;            /* unwrap: last is valid */
+  lma_index *idx;           /* block index */
+  uint64_t blocks;          /* blocks in index */
+  uint64_t cap;             /* allocated index entries */
+  uint64_t next;            /* next block to read */
+  uint64_t offset;          /* next block offset (writer) */
+  uint64_t size;            /* file size (reader) */
+};
+
+/* Multichannel scaler */
+struct lm_mcs {
+  uint32_t dwell;           /* bin width (us) */
+  uint32_t *bins;           /* ring of bins */
+  int cap;                  /* ring size */
+  int head;                 /* ring index of bin 'first' */
+  uint64_t first;           /* oldest bin in ring */
+  int started;              /* first anchored at the first time word */
+  uint64_t now;             /* latest device time seen (us) */
+  uint64_t ts;              /* last time word, unwrapped */
+  uint64_t epoch;           /* unwrap state of time words */
+  uint32_t last;
+  int have_last;
+  uint64_t late;            /* events in bins already returned, or
+			       before the first time word */
+  uint64_t dropped;         /* events in bins pushed out of the ring */
+};
+
+/* List mode filter */
+#define LM_AMP_LEN      1024       /* amplitudes (10 bits) */
+#define LM_MAX_WINDOWS  256        /* max time windows */
+
+struct lm_filter {
+  uint8_t amp[LM_AMP_LEN];  /* 1 if amplitude is accepted */
+  int amp_set;              /* amp[] set by user, else all accepted */
+  uint32_t start[LM_MAX_WINDOWS]; /* time windows [start, end), sorted */
+  uint32_t end[LM_MAX_WINDOWS];
+  int nwin;                 /* 0: all times accepted */
+  int cur;                  /* window of last event */
+  uint64_t last;            /* time of last event (after t0) */
+  uint64_t ts;              /* last time word, unwrapped */
+  uint64_t t0;              /* first time word, windows start here */
+  int started;              /* t0 is set */
+  uint64_t epoch;           /* unwrap state of time words */
+  uint32_t tlast;
+  int have_last;
+  uint64_t passed;          /* accepted events */
+  uint64_t rejected;        /* rejected events */
+};
+
+/* Time-sliced spectra from list mode */
+#define LM_SUB_HIST     4          /* sub-histograms (store conflicts) */
+
+struct lm_spectra {
+  uint64_t slice;           /* slice length (us) */
+  uint64_t cur;             /* slice being filled */
+  int started;              /* cur anchored at the first time word */
+  uint64_t now;             /* latest device time seen (us) */
+  uint64_t ts;              /* last time word, unwrapped */
+  uint64_t epoch;           /* unwrap state of time words */
+  uint32_t last;
+  int have_last;
+  uint64_t late;            /* events in slices already closed, or
+			       before the first time word */
+  int32_t sub[LM_SUB_HIST][DBASE_LEN+1]; /* slice 'cur' */
+  int32_t *done;            /* completed slices, DBASE_LEN+1 each */
+  int ndone, head, cap;     /* queue of completed slices */
+  uint64_t first;           /* slice number of done[head] */
+};
+
+/* Coincidence engine */
+#define LM_COINC_QUEUE  65536      /* reorder buffer per detector (events, 2^n) */
+
+typedef struct {
+  lm_event *ev;             /* ring of LM_COINC_QUEUE events, time ordered */
+  int head, n;
+  int64_t offset;           /* time correction (us) */
+  uint64_t reached;         /* the detector has reached this time */
+  uint64_t epoch;           /* unwrap state */
+  uint32_t last;
+  int have_last;
+} lm_coinc_det;
+
+struct lm_coinc {
+  int ndet;
+  uint64_t window;          /* coincidence window (us) */
+  int mult;                 /* min number of detectors */
+  uint32_t veto;            /* veto detectors */
+  lm_coinc_det *d;
+  lm_group cur;             /* open group */
+  lm_group *out;            /* ring of completed groups */
+  int ohead, on, ocap;
+  uint64_t forced;          /* events merged early (full buffer) */
+  uint64_t dropped;         /* events not fitting in a group */
+};
+
+/* Clock model */
+struct lm_clock {
+  uint32_t id;
+  uint64_t span;            /* forgetting time constant (us) */
+  uint64_t x0, y0;          /* first sample, sums are relative to it */
+  double sw, sx, sy, sxx, sxy; /* weighted sums */
+  double a, b;              /* host - y0 = a + b * (device - x0) */
+  uint64_t last_x;          /* device time of last sample */
+  uint64_t samples;
+  uint64_t ts;              /* last time word, unwrapped */
+  uint64_t epoch;           /* unwrap state of time words */
+  uint32_t last;
+  int have_last;
+};
+
+/* Rossi-alpha */
+#define LM_ROSSI_RING   65536      /* max events within the window (2^n) */
+
+struct lm_rossi {
+  uint64_t width;           /* bin width (us) */
+  uint64_t window;          /* nbins * width */
+  int nbins;
+  uint64_t *hist;
+  uint64_t *ring;           /* recent event times */
+  int head, n;
+  uint64_t overflow;        /* events pushed out of a full ring */
+  uint64_t epoch;           /* unwrap state */
+  uint32_t last;
+  int have_last;
+};
+
+/* Feynman-Y */
+typedef struct {
+  uint64_t gates;           /* closed gates */
+  double s1, s2;            /* sum of counts, sum of squares */
+  uint64_t cnt;             /* counts of the open gate */
+} lm_feynman_width;
+
+struct lm_feynman {
+  uint64_t gate;            /* base gate (us) */
+  int ngates;
+  lm_feynman_width *w;      /* width k+1 gates */
+  uint64_t cur;             /* open base gate */
+  uint64_t cnt;             /* counts in it */
+  uint64_t closed;          /* base gates closed */
+  int started;
+  uint64_t epoch;           /* unwrap state */
+  uint32_t last;
+  int have_last;
+};
+
+/* Inter-arrival times */
+struct lm_iat {
+  uint64_t hist[LM_IAT_BINS];
+  uint64_t tail;            /* tail start (us) */
+  uint64_t n_tail;          /* intervals in the tail */
+  uint64_t s_tail;          /* sum of (interval - tail) */
+  uint64_t events;
+  uint64_t prev;            /* last event time */
+  int chain;                /* prev is valid, next event gives an interval */
+  uint64_t intervals;       /* intervals in hist */
+  uint64_t span;            /* sum of the intervals (us) */
+  uint64_t ts;              /* last time word, unwrapped */
+  uint64_t epoch;           /* unwrap state */
+  uint32_t last;
+  int have_last;
+};
+
+/* Synthetic list mode generator */
+struct lm_gen {
+  lm_gen_cfg cfg;
+  uint64_t s;               /* xorshift state */
+  uint64_t t;               /* time of the next event (us) */
+  uint64_t next_ts;         /* time of the next time word */
+  int left;                 /* events left in the burst */
+  double frac;              /* fractional us carried over */
+};
+
+/*
+  Spectrum snapshots: two slots, each a seqlock (odd sequence
+  while it is written). 'latest' is the sequence number of the 
+  newest complete snapshot, in slot latest & 1. Accessed with
+  the gcc __atomic builtins only.
+*/
+typedef struct {
+  uint64_t seq;             /* odd while written */
+  spec_snapshot s;
+} spec_slot;
+
+struct spec_snap {
+  uint64_t latest;
+  spec_slot slot[2];
+};
+
+/* Sliding window spectrum */
+struct spec_window {
+  int nslots;
+  uint64_t span;            /* max age (us), 0 = none */
+  int32_t *ring;            /* nslots diff spectra */
+  uint64_t *time;           /* readout times */
+  int head, n;              /* oldest slot, slots in use */
+  int64_t sum[DBASE_LEN+1]; /* window sum */
+};
+
+/*
+  Spectrum time pyramid: one ring of nodes per level, oldest 
+  at head. Nodes are identified by readout sequence numbers
+  s0..s1, so a query never counts a readout twice.
+*/
+#define PYR_MAX_LEVELS  8
+
+typedef struct {
+  uint64_t dur;             /* bucket length (us), 0 = per readout */
+  int32_t *spec;            /* cap node spectra */
+  uint64_t *t0, *t1;        /* start of first / end of last readout */
+  uint64_t *s0, *s1;        /* first / last readout */
+  uint64_t *id;             /* bucket */
+  int head, n;
+} pyr_level;
+
+struct spec_pyramid {
+  int nlev, cap;
+  pyr_level lev[PYR_MAX_LEVELS];
+  uint64_t seq;             /* readouts pushed */
+  uint64_t last;            /* time of the last readout */
+};
+
+/* ROI registry */
+typedef struct {
+  uint lo, hi, bg;
+} roi_def;
+
+struct roi_set {
+  roi_def *roi;
+  int n, cap;
+  int64_t prefix[DBASE_LEN+2]; /* prefix[k] = sum of channels 0..k-1 */
+};
+
+/*
+  Spectrum store: a STORE_HDR_SIZE header page, then the records.
+  count is written after the record and its index entry.
+*/
+#define STORE_MAGIC     "DBSPSTR1"
+#define STORE_ORDER     0x01020304u  /* host order check */
+#define STORE_HDR_SIZE  4096
+#define STORE_EXTENT    1024         /* records per growth step */
+
+typedef struct {
+  char magic[8];
+  uint32_t order;
+  uint32_t rec_size;        /* sizeof(spec_record) */
+  uint32_t channels;        /* DBASE_LEN+1 */
+  uint32_t reserved;
+  uint64_t count;           /* committed records */
+} store_hdr;
+
+/* 
+  64-bit accumulator, prev is the last device spectrum (the
+  baseline is taken on the next feed if have_prev is 0)
+*/
+#define ACCUM_MAGIC     "DBACCUM1"
+
+struct spec_accum {
+  uint64_t sum[DBASE_LEN+1];
+  uint32_t prev[DBASE_LEN+1];
+  int have_prev;
+  uint64_t epoch;           /* wall time (us) */
+  uint64_t resets;          /* clears seen */
+};
+
+/*
+  Energy calibration: rebinning matrix by output bin, bin b
+  is the dot product of the weights w[off[b]..] with channels
+  ch[b].. in n[b] chunks of 4 (zero padded)
+*/
+struct spec_calib {
+  double coef[CALIB_MAX_COEF];
+  int ncoef;
+  double e0, e1;
+  int nbins;
+  int *ch, *off, *n;        /* nbins each */
+  double *w;                /* weights */
+  double *out;              /* last readout, rebinned */
+};
+
+/*
+  Peak tracker. The work arrays are padded by PEAK_PAD channels
+  on each side for the convolution.
+*/
+#define PEAK_PAD        12         /* >= PEAK_MAX_SMOOTH + 1, multiple of 4 */
+#define PEAK_MIN_COUNTS 1000       /* counts before the first search */
+
+struct spec_peaks {
+  double thresh, rescan;
+  int smooth;
+  int nh;                   /* filter length, 2 * smooth + 3 */
+  double h[2 * PEAK_MAX_SMOOTH + 4], h2[2 * PEAK_MAX_SMOOTH + 4];
+  double y[DBASE_LEN + 1 + 2 * PEAK_PAD];
+  double dd[DBASE_LEN + 1 + 4], var[DBASE_LEN + 1 + 4];
+  peak_info peak[PEAK_MAX];
+  int n, next_id;
+  int64_t at_scan;          /* counts at the last search */
+  int64_t since;            /* counts since */
+};
+
+/* Memory-mapped file */
+typedef struct {
+  int fd;
+  unsigned char *base;
+  size_t size;
+} store_map;
+
+struct spec_store {
+  int rw;
+  store_map data, idx;
+  store_hdr *hdr;           /* in data */
+  uint64_t *time;           /* in idx */
+  uint64_t cap;             /* records mapped */
+};
 	
 /*
   Some constants
@@ -234,7 +608,24 @@ extern "C" {
 			 int32_t *last);
   
   /*
-    Print's one spectrum to file stream
+    Spectrum update: raw (little endian) spectrum in, 
+    last = raw - chans, chans = raw. Returns 1 if chans was
+    all zeros (first readout after a clear).
+  */
+  int dbase_spectrum_diff(const int32_t *raw, int32_t *chans, 
+			  int32_t *last, int len);
+
+  /* Max ASCII size of a spectrum of len channels ("-2147483648 " each) */
+#define DBASE_SPEC_CHARS(len) (12 * (len) + 1)
+
+  /* Decimal digits of v to p, returns end */
+  char *dbase_itoa(char *p, int32_t v);
+
+  /* Spectrum as ASCII into buf (DBASE_SPEC_CHARS(len)), returns bytes */
+  int dbase_format_spectrum(const int32_t *spec, int len, char *buf);
+
+  /*
+    Print's one spectrum to file stream, the stream is not flushed
   */
   void dbase_print_spectrum_file(const int32_t *spec, 
 				 int len, 
@@ -247,6 +638,25 @@ extern "C" {
 					int len, 
 					FILE *fh);
 
+  /*
+    Spectrum frames: a tag byte, the payload length (varint) and
+    the payload, either all channels as LE int32 (dense) or, for
+    each nonzero channel, the number of zero channels skipped and
+    the zigzag value as varints (sparse). The smaller one is used.
+  */
+#define SPEC_FRAME_DENSE  'D'
+#define SPEC_FRAME_SPARSE 'S'
+
+  /* Encode len channels into buf (DBASE_FRAME_MAX), returns bytes */
+  int dbase_encode_spectrum(const int32_t *spec, int len, unsigned char *buf);
+  /* 
+     Decode a frame of n bytes into spec (len channels), returns
+     bytes used, 0 if the frame is incomplete, <0 if invalid.
+  */
+  int dbase_decode_spectrum(const unsigned char *buf, int n, int32_t *spec, int len);
+  /* Write one frame to file stream */
+  void dbase_print_spectrum_frame(const int32_t *spec, int len, FILE *fh);
+
   /*
      JK 
      Initialization functions:
@@ -295,6 +705,89 @@ extern "C" {
 		       struct libusb_device_descriptor desc,
 		       int *serial);
 
+  /*
+    Decode n list mode words (as read by libdbase_read_lm_words())
+    into pulses, *time tracks the last time word.
+    Returns number of pulses.
+  */
+  int dbase_decode_lm(const uint32_t *words, int n, 
+		      pulse *buf, uint32_t *time);
+
+  /*
+    As dbase_decode_lm(), but only events accepted by f are
+    stored, buf can be NULL (count only).
+  */
+  int dbase_decode_lm_filter(const uint32_t *words, int n, pulse *buf, 
+			     uint32_t *time, lm_filter *f);
+
+  /* Is time t (after f->t0) inside a window of f (updates f->cur) */
+  int dbase_lm_filter_time(lm_filter *f, uint64_t t);
+
+  /* Close slices of s before slice number b */
+  int dbase_lm_spectra_close(lm_spectra *s, uint64_t b);
+
+  /* Corrected 64-bit time of pulse time t on detector d */
+  uint64_t dbase_coinc_time(lm_coinc_det *d, uint32_t t);
+  /* Merge buffered events up to time 'upto' into groups */
+  int dbase_coinc_merge(lm_coinc *c, uint64_t upto, int all);
+  /* Close the open group, queue it if it qualifies */
+  int dbase_coinc_close(lm_coinc *c);
+
+  /* Inter-arrival histogram bin of interval dt */
+  int dbase_iat_bin(uint64_t dt);
+
+  /* Generator: uniform (0,1) and standard normal */
+  double dbase_gen_uniform(lm_gen *g);
+  double dbase_gen_normal(lm_gen *g);
+
+  /* Publish det's spectra to its snapshot (if any) */
+  void dbase_snap_publish(detector *det);
+
+  /* The device spectrum was cleared, next readout counts from 0 */
+  void dbase_accum_cleared(spec_accum *acc);
+
+  /* Host wall time (CLOCK_REALTIME, us) */
+  uint64_t dbase_wall_time_us(void);
+
+  /* Add c counts to MCS bin b */
+  void dbase_mcs_add(lm_mcs *mcs, uint64_t b, uint32_t c);
+
+  /*
+    List mode statistics: 
+    account for one time word, ev is the number of events
+    since the previous one
+  */
+  void dbase_lm_time_word(lm_stats *st, uint32_t ts, uint32_t ev);
+
+  /*
+    Varint (LEB128) helpers, return number of bytes used.
+    dbase_get_varint returns <0 if the varint overruns len.
+  */
+  int dbase_put_varint(unsigned char *b, uint64_t v);
+  int dbase_get_varint(const unsigned char *b, int len, uint64_t *v);
+
+  /* Little endian field helpers (independent of host order) */
+  void dbase_put_le32(unsigned char *b, uint32_t v);
+  void dbase_put_le64(unsigned char *b, uint64_t v);
+  uint32_t dbase_get_le32(const unsigned char *b);
+  uint64_t dbase_get_le64(const unsigned char *b);
+
+  /*
+    Extend a 32-bit list mode time to 64 bits,
+    *epoch and *last hold the unwrap state
+  */
+  uint64_t dbase_lm_unwrap(uint64_t *epoch, uint32_t *last, 
+			   int *have_last, uint32_t time);
+
+  /* List-mode archive internals */
+  int dbase_lma_flush_block(lm_archive *ar);
+  int dbase_lma_load_block(lm_archive *ar, uint64_t k);
+  int dbase_lma_load_index(lm_archive *ar);
+  int dbase_lma_scan_index(lm_archive *ar);
+  int dbase_lma_check_block(const lm_archive *ar, uint64_t offset, uint32_t events);
+  int dbase_lma_add_index(lm_archive *ar, uint64_t first, 
+			  uint64_t offset, uint32_t events);
+
   /* Basic detector pointer NULL checks */
   int check_detector(const detector *det, const char *str); 
   
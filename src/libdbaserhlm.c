@@ -0,0 +1,1164 @@
+/*
+ * libdbaserhlm.c: List-mode extensions for libdbaserh
+ * 
+ * Binary list-mode archive (writer and reader), decoding,
+ * filters, multichannel scaling, time-sliced spectra, a
+ * synthetic word generator and helpers shared by the 
+ * list-mode functions.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>     /* error codes */
+#include <math.h>      /* log(), sqrt(), cos() */
+#include <stdio.h>     /* printf(), fprintf(), ... */
+#include <stdlib.h>    /* malloc(), calloc(), free(), ... */
+#include <string.h>    /* memcpy() */
+#include <time.h>      /* time() */
+
+/* libdbase non-public header */
+#include "libdbaserhi.h"
+
+/*
+  Varint (LEB128): 7 bits per byte, msb set on all but the last byte
+*/
+int dbase_put_varint(unsigned char *b, uint64_t v){
+  int n = 0;
+  while(v >= 0x80){
+    b[n++] = (unsigned char) (v | 0x80);
+    v >>= 7;
+  }
+  b[n++] = (unsigned char) v;
+  return n;
+}
+
+int dbase_get_varint(const unsigned char *b, int len, uint64_t *v){
+  int n = 0, shift = 0;
+  uint64_t r = 0;
+  while(n < len && shift < 64){
+    r |= (uint64_t) (b[n] & 0x7f) << shift;
+    if((b[n++] & 0x80) == 0){
+      *v = r;
+      return n;
+    }
+    shift += 7;
+  }
+  return -1;
+}
+
+/*
+  Little endian fields
+*/
+void dbase_put_le32(unsigned char *b, uint32_t v){
+  int k;
+  for(k = 0; k < 4; k++)
+    b[k] = (unsigned char) (v >> (8 * k));
+}
+
+void dbase_put_le64(unsigned char *b, uint64_t v){
+  dbase_put_le32(b, (uint32_t) v);
+  dbase_put_le32(b + 4, (uint32_t) (v >> 32));
+}
+
+uint32_t dbase_get_le32(const unsigned char *b){
+  return (uint32_t) b[0] | ((uint32_t) b[1] << 8) | 
+    ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+uint64_t dbase_get_le64(const unsigned char *b){
+  return (uint64_t) dbase_get_le32(b) | ((uint64_t) dbase_get_le32(b + 4) << 32);
+}
+
+/*
+  Unwrap list mode times.
+  Pulse times are (time word + offset) and roll over every
+  TS_PERIOD us. A large step backwards is a rollover, a large
+  step forwards is a late event from before the last rollover.
+*/
+uint64_t dbase_lm_unwrap(uint64_t *epoch, uint32_t *last, 
+			 int *have_last, uint32_t time){
+  if(*have_last){
+    int64_t d = (int64_t) time - (int64_t) *last;
+    if(d < -(int64_t)(TS_PERIOD / 2))
+      *epoch += TS_PERIOD;
+    else if(d > (int64_t)(TS_PERIOD / 2) && *epoch >= TS_PERIOD)
+      return *epoch - TS_PERIOD + time;
+  }
+  *last = time;
+  *have_last = 1;
+  return *epoch + time;
+}
+
+/*
+  Open list-mode archive for writing
+*/
+lm_archive *libdbase_lm_archive_open_write(FILE *fh, int serial){
+  if(fh == NULL){
+    fprintf(stderr, "E: libdbase_lm_archive_open_write(), *fh was NULL\n");
+    return NULL;
+  }
+  lm_archive *ar = (lm_archive *) calloc(1, sizeof(lm_archive));
+  if(ar == NULL){
+    fprintf(stderr, "E: libdbase_lm_archive_open_write() unable to allocate memory\n");
+    return NULL;
+  }
+  ar->bsize = LM_ARCHIVE_BLOCK;
+  ar->blk = (unsigned char *) malloc(ar->bsize);
+  if(ar->blk == NULL){
+    fprintf(stderr, "E: libdbase_lm_archive_open_write() unable to allocate memory\n");
+    free(ar);
+    return NULL;
+  }
+  ar->fh = fh;
+  ar->write = 1;
+  ar->serial = serial;
+  ar->pos = LMA_BLK_HEAD;
+
+  /* File header */
+  unsigned char head[LMA_HEAD_LEN];
+  memset(head, 0, sizeof(head));
+  memcpy(head, LMA_MAGIC, 8);
+  dbase_put_le32(head + 8, LMA_VERSION);
+  dbase_put_le32(head + 12, (uint32_t) ar->bsize);
+  dbase_put_le32(head + 16, (uint32_t) serial);
+  dbase_put_le64(head + 24, (uint64_t) time(NULL));
+  if(fwrite(head, 1, sizeof(head), fh) != sizeof(head)){
+    fprintf(stderr, "E: libdbase_lm_archive_open_write() when writing header, errno=%d\n",
+	    errno);
+    free(ar->blk);
+    free(ar);
+    return NULL;
+  }
+  ar->offset = LMA_HEAD_LEN;
+  return ar;
+}
+
+/*
+  Append pulses to archive
+*/
+int libdbase_lm_archive_write(lm_archive *ar, const pulse *buf, int n){
+  if(ar == NULL || !ar->write || (buf == NULL && n > 0)){
+    fprintf(stderr, "E: libdbase_lm_archive_write(), archive not open for writing\n");
+    return -1;
+  }
+  int k, err;
+  uint64_t t, zz;
+  int64_t dt;
+  for(k = 0; k < n; k++){
+    t = dbase_lm_unwrap(&ar->epoch, &ar->last, &ar->have_last, buf[k].time);
+    /* Block full? */
+    if(ar->pos + LMA_MAX_EVENT > ar->bsize){
+      if( (err = dbase_lma_flush_block(ar)) < 0)
+	return err;
+    }
+    /* First event in block sets the block time */
+    if(ar->events == 0)
+      ar->first = ar->prev = t;
+    /* zigzag, late events give small negative steps */
+    dt = (int64_t) (t - ar->prev);
+    zz = ((uint64_t) dt << 1) ^ (uint64_t) (dt >> 63);
+    ar->pos += dbase_put_varint(ar->blk + ar->pos, zz);
+    ar->pos += dbase_put_varint(ar->blk + ar->pos, buf[k].amp);
+    ar->prev = t;
+    ar->events++;
+  }
+  return 0;
+}
+
+/*
+  Time word from the readout, keeps the unwrapping in step
+*/
+int libdbase_lm_archive_time(lm_archive *ar, uint32_t time){
+  if(ar == NULL || !ar->write){
+    fprintf(stderr, "E: libdbase_lm_archive_time(), archive not open for writing\n");
+    return -1;
+  }
+  dbase_lm_unwrap(&ar->epoch, &ar->last, &ar->have_last, time);
+  return 0;
+}
+
+/*
+  Write current block (padded to block size) and index it
+*/
+int dbase_lma_flush_block(lm_archive *ar){
+  if(ar->events == 0)
+    return 0;
+  dbase_put_le32(ar->blk, LMA_BLK_MAGIC);
+  dbase_put_le32(ar->blk + 4, ar->events);
+  dbase_put_le64(ar->blk + 8, ar->first);
+  dbase_put_le32(ar->blk + 16, (uint32_t) (ar->pos - LMA_BLK_HEAD));
+  dbase_put_le32(ar->blk + 20, 0);
+  memset(ar->blk + ar->pos, 0, ar->bsize - ar->pos);
+
+  if(fwrite(ar->blk, 1, ar->bsize, ar->fh) != (size_t) ar->bsize){
+    fprintf(stderr, "E: dbase_lma_flush_block() when writing block, errno=%d\n", errno);
+    return -EIO;
+  }
+  if(dbase_lma_add_index(ar, ar->first, ar->offset, ar->events) < 0)
+    return -ENOMEM;
+  ar->offset += ar->bsize;
+  ar->pos = LMA_BLK_HEAD;
+  ar->events = 0;
+  return 0;
+}
+
+/*
+  Append one entry to the block index
+*/
+int dbase_lma_add_index(lm_archive *ar, uint64_t first, 
+			uint64_t offset, uint32_t events){
+  if(ar->blocks == ar->cap){
+    uint64_t cap = ar->cap == 0 ? 256 : 2 * ar->cap;
+    lma_index *idx = (lma_index *) realloc(ar->idx, cap * sizeof(lma_index));
+    if(idx == NULL){
+      fprintf(stderr, "E: dbase_lma_add_index() unable to allocate memory\n");
+      return -ENOMEM;
+    }
+    ar->idx = idx;
+    ar->cap = cap;
+  }
+  ar->idx[ar->blocks].first = first;
+  ar->idx[ar->blocks].offset = offset;
+  ar->idx[ar->blocks].events = events;
+  ar->blocks++;
+  return 0;
+}
+
+/*
+  Close archive, writers write the last block, index and trailer
+*/
+int libdbase_lm_archive_close(lm_archive *ar){
+  if(ar == NULL)
+    return -1;
+  int err = 0;
+  if(ar->write){
+    err = dbase_lma_flush_block(ar);
+    if(err >= 0){
+      /* Index (one write) and trailer */
+      size_t n = ar->blocks * LMA_IDX_LEN + LMA_TAIL_LEN;
+      unsigned char *b = (unsigned char *) calloc(n, 1);
+      uint64_t k;
+      if(b == NULL){
+	fprintf(stderr, "E: libdbase_lm_archive_close() unable to allocate index\n");
+	err = -ENOMEM;
+      }
+      else {
+	for(k = 0; k < ar->blocks; k++){
+	  dbase_put_le64(b + k * LMA_IDX_LEN, ar->idx[k].first);
+	  dbase_put_le64(b + k * LMA_IDX_LEN + 8, ar->idx[k].offset);
+	  dbase_put_le32(b + k * LMA_IDX_LEN + 16, ar->idx[k].events);
+	}
+	memcpy(b + n - LMA_TAIL_LEN, LMA_IDX_MAGIC, 8);
+	dbase_put_le64(b + n - 16, ar->blocks);
+	dbase_put_le64(b + n - 8, ar->offset);
+	if(fwrite(b, 1, n, ar->fh) != n){
+	  fprintf(stderr, "E: libdbase_lm_archive_close() when writing index, errno=%d\n", 
+		  errno);
+	  err = -EIO;
+	}
+	free(b);
+      }
+    }
+    if( fflush(ar->fh) < 0 )
+      fprintf(stderr, "E: libdbase_lm_archive_close() when flushing stream\n");
+  }
+  free(ar->idx);
+  free(ar->blk);
+  free(ar);
+  return err;
+}
+
+/*
+  Open list-mode archive for reading
+*/
+lm_archive *libdbase_lm_archive_open_read(FILE *fh){
+  if(fh == NULL){
+    fprintf(stderr, "E: libdbase_lm_archive_open_read(), *fh was NULL\n");
+    return NULL;
+  }
+  unsigned char head[LMA_HEAD_LEN];
+  off_t size;
+  if(fseeko(fh, 0, SEEK_END) != 0 || (size = ftello(fh)) < 0 ||
+     fseeko(fh, 0, SEEK_SET) != 0 || 
+     fread(head, 1, sizeof(head), fh) != sizeof(head) ||
+     memcmp(head, LMA_MAGIC, 8) != 0){
+    fprintf(stderr, "E: libdbase_lm_archive_open_read() not a list-mode archive\n");
+    return NULL;
+  }
+  if(dbase_get_le32(head + 8) != LMA_VERSION ||
+     dbase_get_le32(head + 12) < LMA_BLK_HEAD + LMA_MAX_EVENT ||
+     dbase_get_le32(head + 12) > LM_ARCHIVE_BLOCK){
+    fprintf(stderr, "E: libdbase_lm_archive_open_read() unsupported version or block size\n");
+    return NULL;
+  }
+
+  lm_archive *ar = (lm_archive *) calloc(1, sizeof(lm_archive));
+  if(ar == NULL){
+    fprintf(stderr, "E: libdbase_lm_archive_open_read() unable to allocate memory\n");
+    return NULL;
+  }
+  ar->fh = fh;
+  ar->size = (uint64_t) size;
+  ar->serial = (int) dbase_get_le32(head + 16);
+  ar->bsize = (int) dbase_get_le32(head + 12);
+  ar->blk = (unsigned char *) malloc(ar->bsize);
+  if(ar->blk == NULL){
+    fprintf(stderr, "E: libdbase_lm_archive_open_read() unable to allocate memory\n");
+    free(ar);
+    return NULL;
+  }
+  /* Use the stored index, else rebuild it */
+  if(dbase_lma_load_index(ar) < 0 && dbase_lma_scan_index(ar) < 0){
+    libdbase_lm_archive_close(ar);
+    return NULL;
+  }
+  if(_DEBUG > 0)
+    printf("List-mode archive: serial %d, %llu blocks\n", 
+	   ar->serial, (unsigned long long) ar->blocks);
+  return ar;
+}
+
+/*
+  Block header plausible? The whole block must be in the file
+  and its events must fit in its payload.
+*/
+int dbase_lma_check_block(const lm_archive *ar, uint64_t offset, uint32_t events){
+  return offset >= LMA_HEAD_LEN && offset + ar->bsize <= ar->size &&
+    events <= (uint32_t) ((ar->bsize - LMA_BLK_HEAD) / LMA_MIN_EVENT);
+}
+
+/*
+  Read index written by libdbase_lm_archive_close()
+*/
+int dbase_lma_load_index(lm_archive *ar){
+  unsigned char tail[LMA_TAIL_LEN], *b;
+  uint64_t n, off, k;
+  if(ar->size < LMA_HEAD_LEN + LMA_TAIL_LEN ||
+     fseeko(ar->fh, -LMA_TAIL_LEN, SEEK_END) != 0 ||
+     fread(tail, 1, sizeof(tail), ar->fh) != sizeof(tail) ||
+     memcmp(tail, LMA_IDX_MAGIC, 8) != 0)
+    return -1;
+  n = dbase_get_le64(tail + 8);
+  off = dbase_get_le64(tail + 16);
+  /* Index lies between the blocks and the trailer */
+  if(off < LMA_HEAD_LEN || off > ar->size - LMA_TAIL_LEN ||
+     n != (ar->size - LMA_TAIL_LEN - off) / LMA_IDX_LEN)
+    return -1;
+  if(n == 0)
+    return 0;
+  b = (unsigned char *) malloc(n * LMA_IDX_LEN);
+  if(b == NULL || fseeko(ar->fh, (off_t) off, SEEK_SET) != 0 ||
+     fread(b, LMA_IDX_LEN, n, ar->fh) != n){
+    free(b);
+    return -1;
+  }
+  for(k = 0; k < n; k++){
+    if(!dbase_lma_check_block(ar, dbase_get_le64(b + k * LMA_IDX_LEN + 8),
+			      dbase_get_le32(b + k * LMA_IDX_LEN + 16)) ||
+       dbase_get_le64(b + k * LMA_IDX_LEN + 8) + ar->bsize > off ||
+       dbase_lma_add_index(ar, 
+			   dbase_get_le64(b + k * LMA_IDX_LEN),
+			   dbase_get_le64(b + k * LMA_IDX_LEN + 8),
+			   dbase_get_le32(b + k * LMA_IDX_LEN + 16)) < 0){
+      free(b);
+      return -1;
+    }
+  }
+  free(b);
+  return 0;
+}
+
+/*
+  Rebuild index from block headers (archive was never closed)
+*/
+int dbase_lma_scan_index(lm_archive *ar){
+  unsigned char head[LMA_BLK_HEAD];
+  off_t off = LMA_HEAD_LEN;
+  ar->blocks = 0;
+  if(_DEBUG > 0)
+    printf("List-mode archive has no index, scanning blocks\n");
+  while(fseeko(ar->fh, off, SEEK_SET) == 0 &&
+	fread(head, 1, sizeof(head), ar->fh) == sizeof(head) &&
+	dbase_get_le32(head) == LMA_BLK_MAGIC &&
+	dbase_lma_check_block(ar, (uint64_t) off, dbase_get_le32(head + 4))){
+    if(dbase_lma_add_index(ar, dbase_get_le64(head + 8), 
+			   (uint64_t) off, dbase_get_le32(head + 4)) < 0)
+      return -1;
+    off += ar->bsize;
+  }
+  return 0;
+}
+
+/*
+  Load block k into the read buffer
+*/
+int dbase_lma_load_block(lm_archive *ar, uint64_t k){
+  if(k >= ar->blocks)
+    return -1;
+  if(fseeko(ar->fh, (off_t) ar->idx[k].offset, SEEK_SET) != 0 ||
+     fread(ar->blk, 1, ar->bsize, ar->fh) != (size_t) ar->bsize ||
+     dbase_get_le32(ar->blk) != LMA_BLK_MAGIC){
+    fprintf(stderr, "E: dbase_lma_load_block() unable to read block %llu\n",
+	    (unsigned long long) k);
+    return -EIO;
+  }
+  /* Payload and events must fit in the block */
+  if(dbase_get_le32(ar->blk + 16) > (uint32_t) (ar->bsize - LMA_BLK_HEAD) ||
+     dbase_get_le32(ar->blk + 4) > dbase_get_le32(ar->blk + 16) / LMA_MIN_EVENT){
+    fprintf(stderr, "E: dbase_lma_load_block() corrupt block %llu\n",
+	    (unsigned long long) k);
+    return -EIO;
+  }
+  ar->left = dbase_get_le32(ar->blk + 4);
+  ar->prev = dbase_get_le64(ar->blk + 8);
+  ar->used = LMA_BLK_HEAD + (int) dbase_get_le32(ar->blk + 16);
+  ar->pos = LMA_BLK_HEAD;
+  ar->next = k + 1;
+  return 0;
+}
+
+/*
+  Read events from archive
+*/
+int libdbase_lm_archive_read(lm_archive *ar, lm_event *buf, int len, int *read){
+  if(ar == NULL || ar->write || buf == NULL || read == NULL){
+    fprintf(stderr, "E: libdbase_lm_archive_read(), archive not open for reading\n");
+    return -1;
+  }
+  int r = 0, n, m, err;
+  uint64_t zz, amp;
+  while(r < len){
+    /* Next block */
+    if(ar->left == 0){
+      if(ar->next >= ar->blocks)
+	break;
+      if( (err = dbase_lma_load_block(ar, ar->next)) < 0){
+	*read = r;
+	return err;
+      }
+      continue;
+    }
+    n = dbase_get_varint(ar->blk + ar->pos, ar->used - ar->pos, &zz);
+    m = n < 0 ? -1 : dbase_get_varint(ar->blk + ar->pos + n, ar->used - ar->pos - n, &amp);
+    if(m < 0){
+      fprintf(stderr, "E: libdbase_lm_archive_read() corrupt block %llu\n",
+	      (unsigned long long) (ar->next - 1));
+      ar->left = 0;
+      continue;
+    }
+    ar->pos += n + m;
+    ar->prev += (uint64_t) ((int64_t) (zz >> 1) ^ -(int64_t) (zz & 1));
+    buf[r].time = ar->prev;
+    buf[r].amp = (uint32_t) amp;
+    buf[r].det = 0;
+    ar->left--;
+    r++;
+  }
+  *read = r;
+  return 0;
+}
+
+/*
+  Seek to first event at or after time
+*/
+int libdbase_lm_archive_seek(lm_archive *ar, uint64_t time){
+  if(ar == NULL || ar->write){
+    fprintf(stderr, "E: libdbase_lm_archive_seek(), archive not open for reading\n");
+    return -1;
+  }
+  if(ar->blocks == 0)
+    return -1;
+  /* Last block starting at or before time */
+  uint64_t lo = 0, hi = ar->blocks, mid;
+  while(hi - lo > 1){
+    mid = lo + (hi - lo) / 2;
+    if(ar->idx[mid].first <= time)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  if(dbase_lma_load_block(ar, lo) < 0)
+    return -1;
+
+  /* Skip earlier events, stop in front of the first later one */
+  lm_event ev;
+  int pos, read;
+  uint32_t left;
+  uint64_t prev, next;
+  for(;;){
+    pos = ar->pos; left = ar->left; prev = ar->prev; next = ar->next;
+    if(libdbase_lm_archive_read(ar, &ev, 1, &read) < 0 || read == 0)
+      return -1;
+    if(ev.time >= time){
+      /* 
+	 Rewind. If a new block was loaded, left was 0 and the
+	 next read loads that block again.
+      */
+      ar->pos = pos; ar->left = left; ar->prev = prev; ar->next = next;
+      return 0;
+    }
+  }
+}
+
+/*
+  Archive info
+*/
+int libdbase_lm_archive_info(const lm_archive *ar, int *serial, 
+			     uint64_t *events, uint64_t *first){
+  if(ar == NULL)
+    return -1;
+  uint64_t k, n = ar->events;
+  for(k = 0; k < ar->blocks; k++)
+    n += ar->idx[k].events;
+  if(serial != NULL)
+    *serial = ar->serial;
+  if(events != NULL)
+    *events = n;
+  if(first != NULL)
+    *first = ar->blocks > 0 ? ar->idx[0].first : ar->first;
+  return 0;
+}
+
+/*
+  Decode list mode words into pulses
+*/
+int dbase_decode_lm(const uint32_t *words, int n, pulse *buf, uint32_t *time){
+  int k, r = 0;
+  for(k=0; k < n; k++)
+    {
+      /* End of data? */	
+      if(words[k] == 0)
+	break;
+      /* Amplitude & time? */
+      else if(words[k] <= TS_MASK){
+	buf[r].amp =  (uint32_t) ((words[k] & A_MASK) >> 21);
+	/* First time tick after (in worst case) MAX_T us */
+	buf[r].time = (uint32_t) (words[k] & T_MASK);
+	/* Timer rollover? */
+	if(buf[r].time > MAX_T){
+	  buf[r].time -= MAX_T;
+	}
+	buf[r].time += time[0];
+	r++;
+      }
+      /* Timestamp then */
+      else
+	time[0] = (uint32_t) (words[k] & TS_MASK);
+    }
+  return r;
+}
+
+/*
+  Multichannel scaler
+*/
+lm_mcs *libdbase_lm_mcs_new(uint32_t dwell, int nbins){
+  if(dwell == 0 || nbins <= 0){
+    fprintf(stderr, "E: libdbase_lm_mcs_new(), dwell and nbins must be positive\n");
+    return NULL;
+  }
+  lm_mcs *mcs = (lm_mcs *) calloc(1, sizeof(lm_mcs));
+  if(mcs == NULL){
+    fprintf(stderr, "E: libdbase_lm_mcs_new() unable to allocate memory\n");
+    return NULL;
+  }
+  mcs->bins = (uint32_t *) calloc(nbins, sizeof(uint32_t));
+  if(mcs->bins == NULL){
+    fprintf(stderr, "E: libdbase_lm_mcs_new() unable to allocate memory\n");
+    free(mcs);
+    return NULL;
+  }
+  mcs->dwell = dwell;
+  mcs->cap = nbins;
+  return mcs;
+}
+
+void libdbase_lm_mcs_free(lm_mcs *mcs){
+  if(mcs == NULL)
+    return;
+  free(mcs->bins);
+  free(mcs);
+}
+
+/*
+  Add counts to a bin, moving the ring forward if needed
+*/
+void dbase_mcs_add(lm_mcs *mcs, uint64_t b, uint32_t c){
+  int k;
+  if(b < mcs->first){
+    mcs->late += c;
+    return;
+  }
+  /* Gap longer than the ring, all bins are pushed out at once */
+  if(b - mcs->first >= 2 * (uint64_t) mcs->cap){
+    for(k = 0; k < mcs->cap; k++)
+      mcs->dropped += mcs->bins[k];
+    memset(mcs->bins, 0, mcs->cap * sizeof(uint32_t));
+    mcs->head = 0;
+    mcs->first = b - mcs->cap + 1;
+  }
+  /* Push the oldest bins out */
+  while(b >= mcs->first + mcs->cap){
+    mcs->dropped += mcs->bins[mcs->head];
+    mcs->bins[mcs->head] = 0;
+    mcs->head = (mcs->head + 1) % mcs->cap;
+    mcs->first++;
+  }
+  mcs->bins[(mcs->head + (b - mcs->first)) % mcs->cap] += c;
+}
+
+/*
+  Bin raw words.
+  Words between two time words form a segment with times
+  (time word + offset), offset <= MAX_T + 1. A segment that
+  fits in one bin is counted as a whole, which is decided by a 
+  branch-free max over the offsets. Only segments across bin
+  boundaries are binned event by event.
+*/
+int libdbase_lm_mcs_feed(lm_mcs *mcs, const uint32_t *words, int n){
+  if(mcs == NULL || (words == NULL && n > 0)){
+    fprintf(stderr, "E: libdbase_lm_mcs_feed(), mcs or words was NULL\n");
+    return -1;
+  }
+  int k = 0, e, j;
+  uint32_t off, maxo;
+  uint64_t b, rel;
+  while(k < n){
+    /* End of data? */
+    if(words[k] == 0)
+      break;
+    /* Time word */
+    if(words[k] > TS_MASK){
+      mcs->ts = dbase_lm_unwrap(&mcs->epoch, &mcs->last, &mcs->have_last, 
+				words[k] & TS_MASK);
+      /* The ring starts at the first time word */
+      if(!mcs->started){
+	mcs->first = mcs->ts / mcs->dwell;
+	mcs->started = 1;
+      }
+      if(mcs->ts > mcs->now)
+	mcs->now = mcs->ts;
+      k++;
+      continue;
+    }
+    /* Segment of events [k, e) */
+    for(e = k; e < n && words[e] != 0 && words[e] <= TS_MASK; e++)
+      ;
+    /* No time word yet, the events can't be timed */
+    if(!mcs->started){
+      mcs->late += e - k;
+      k = e;
+      continue;
+    }
+    maxo = 0;
+    for(j = k; j < e; j++){
+      off = words[j] & T_MASK;
+      off -= (off > MAX_T) ? MAX_T : 0;
+      maxo = off > maxo ? off : maxo;
+    }
+    b = mcs->ts / mcs->dwell;
+    rel = mcs->ts - b * mcs->dwell;
+    if(rel + maxo < mcs->dwell)
+      dbase_mcs_add(mcs, b, (uint32_t) (e - k));
+    else {
+      for(j = k; j < e; j++){
+	off = words[j] & T_MASK;
+	off -= (off > MAX_T) ? MAX_T : 0;
+	dbase_mcs_add(mcs, b + (rel + off) / mcs->dwell, 1);
+      }
+    }
+    if(mcs->ts + maxo > mcs->now)
+      mcs->now = mcs->ts + maxo;
+    k = e;
+  }
+  return 0;
+}
+
+/*
+  Read from device and bin
+*/
+int libdbase_read_lm_mcs(detector *det, lm_mcs *mcs, uint32_t *words, int len){
+  int n, err;
+  err = libdbase_read_lm_words(det, words, len, &n);
+  if(err < 0)
+    return err;
+  if(libdbase_lm_mcs_feed(mcs, words, n) < 0)
+    return -1;
+  return err;
+}
+
+/*
+  Fetch completed bins
+*/
+int libdbase_lm_mcs_get(lm_mcs *mcs, uint32_t *counts, int len, uint64_t *first){
+  if(mcs == NULL || counts == NULL){
+    fprintf(stderr, "E: libdbase_lm_mcs_get(), mcs or counts was NULL\n");
+    return -1;
+  }
+  /* Bins ending at or before 'now' are complete */
+  uint64_t done = mcs->now / mcs->dwell;
+  int k = 0;
+  if(first != NULL)
+    *first = mcs->first;
+  while(k < len && mcs->first < done){
+    counts[k++] = mcs->bins[mcs->head];
+    mcs->bins[mcs->head] = 0;
+    mcs->head = (mcs->head + 1) % mcs->cap;
+    mcs->first++;
+  }
+  return k;
+}
+
+void libdbase_lm_mcs_finish(lm_mcs *mcs){
+  if(mcs == NULL || !mcs->started)
+    return;
+  mcs->now = (mcs->now / mcs->dwell + 1) * mcs->dwell;
+}
+
+/*
+  List mode filter
+*/
+lm_filter *libdbase_lm_filter_new(void){
+  lm_filter *f = (lm_filter *) calloc(1, sizeof(lm_filter));
+  if(f == NULL){
+    fprintf(stderr, "E: libdbase_lm_filter_new() unable to allocate memory\n");
+    return NULL;
+  }
+  memset(f->amp, 1, LM_AMP_LEN);
+  return f;
+}
+
+void libdbase_lm_filter_free(lm_filter *f){
+  free(f);
+}
+
+int libdbase_lm_filter_amp(lm_filter *f, uint32_t low, uint32_t high){
+  if(f == NULL || low > high || low >= LM_AMP_LEN){
+    fprintf(stderr, "E: libdbase_lm_filter_amp(), invalid filter or range\n");
+    return -1;
+  }
+  if(high >= LM_AMP_LEN)
+    high = LM_AMP_LEN - 1;
+  /* First range, accept nothing else */
+  if(!f->amp_set){
+    memset(f->amp, 0, LM_AMP_LEN);
+    f->amp_set = 1;
+  }
+  memset(f->amp + low, 1, high - low + 1);
+  return 0;
+}
+
+int libdbase_lm_filter_window(lm_filter *f, uint32_t start, uint32_t end){
+  if(f == NULL || start >= end || f->nwin >= LM_MAX_WINDOWS){
+    fprintf(stderr, "E: libdbase_lm_filter_window(), invalid filter or window\n");
+    return -1;
+  }
+  /* Insert sorted on start */
+  int k = f->nwin;
+  while(k > 0 && f->start[k-1] > start){
+    f->start[k] = f->start[k-1];
+    f->end[k] = f->end[k-1];
+    k--;
+  }
+  f->start[k] = start;
+  f->end[k] = end;
+  f->nwin++;
+  f->cur = 0;
+  return 0;
+}
+
+void libdbase_lm_filter_stats(const lm_filter *f, uint64_t *passed, uint64_t *rejected){
+  if(passed != NULL)
+    *passed = f == NULL ? 0ULL : f->passed;
+  if(rejected != NULL)
+    *rejected = f == NULL ? 0ULL : f->rejected;
+}
+
+int libdbase_set_lm_filter(detector *det, lm_filter *f){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_lm_filter(), detector was NULL\n");
+    return -1;
+  }
+  det->lmf = f;
+  if(f != NULL){
+    f->cur = 0;
+    f->last = 0;
+    f->started = 0;
+    f->epoch = 0;
+    f->have_last = 0;
+  }
+  return 0;
+}
+
+/*
+  Time windows: the event times increase, so the window is
+  tracked with a cursor and only moved forward (restarted if
+  the time goes backwards, i.e. a late event)
+*/
+int dbase_lm_filter_time(lm_filter *f, uint64_t t){
+  if(f->nwin == 0)
+    return 1;
+  if(t < f->last)
+    f->cur = 0;
+  f->last = t;
+  while(f->cur < f->nwin - 1 && t >= f->end[f->cur])
+    f->cur++;
+  /* Overlapping windows */
+  int k;
+  for(k = f->cur; k < f->nwin && f->start[k] <= t; k++)
+    if(t < f->end[k])
+      return 1;
+  return 0;
+}
+
+/*
+  Decode and filter.
+  Events are written unconditionally and the output index only
+  advances for accepted ones, so the amplitude test is a table
+  lookup without branches.
+*/
+int dbase_decode_lm_filter(const uint32_t *words, int n, pulse *buf, 
+			   uint32_t *time, lm_filter *f){
+  int k, r = 0, ok;
+  uint32_t a, t;
+  for(k=0; k < n; k++)
+    {
+      if(words[k] == 0)
+	break;
+      else if(words[k] <= TS_MASK){
+	a = (words[k] & A_MASK) >> 21;
+	t = words[k] & T_MASK;
+	if(t > MAX_T)
+	  t -= MAX_T;
+	/* Windows are on unwrapped time after the first time word */
+	ok = f->amp[a];
+	if(ok && f->nwin > 0)
+	  ok = f->started && dbase_lm_filter_time(f, f->ts + t - f->t0);
+	t += time[0];
+	if(buf != NULL){
+	  buf[r].amp = a;
+	  buf[r].time = t;
+	}
+	r += ok;
+	f->rejected += !ok;
+      }
+      else {
+	time[0] = (uint32_t) (words[k] & TS_MASK);
+	f->ts = dbase_lm_unwrap(&f->epoch, &f->tlast, &f->have_last, time[0]);
+	if(!f->started){
+	  f->t0 = f->ts;
+	  f->started = 1;
+	}
+      }
+    }
+  f->passed += r;
+  return r;
+}
+
+/*
+  Time-sliced spectra
+*/
+lm_spectra *libdbase_lm_spectra_new(uint64_t slice){
+  if(slice == 0ULL){
+    fprintf(stderr, "E: libdbase_lm_spectra_new(), slice must be positive\n");
+    return NULL;
+  }
+  lm_spectra *s = (lm_spectra *) calloc(1, sizeof(lm_spectra));
+  if(s == NULL){
+    fprintf(stderr, "E: libdbase_lm_spectra_new() unable to allocate memory\n");
+    return NULL;
+  }
+  s->slice = slice;
+  return s;
+}
+
+void libdbase_lm_spectra_free(lm_spectra *s){
+  if(s == NULL)
+    return;
+  free(s->done);
+  free(s);
+}
+
+/*
+  Close all slices before b: merge the sub-histograms of
+  the current one, and queue it (and any empty ones after it)
+*/
+int dbase_lm_spectra_close(lm_spectra *s, uint64_t b){
+  int k, j;
+  int32_t *d;
+  while(s->cur < b){
+    /* Grow queue */
+    if(s->ndone == s->cap){
+      int cap = s->cap == 0 ? 16 : 2 * s->cap;
+      int32_t *tmp = (int32_t *) malloc((size_t) cap * (DBASE_LEN+1) * sizeof(int32_t));
+      if(tmp == NULL){
+	fprintf(stderr, "E: dbase_lm_spectra_close() unable to allocate memory\n");
+	return -ENOMEM;
+      }
+      for(k = 0; k < s->ndone; k++)
+	memcpy(tmp + (size_t) k * (DBASE_LEN+1), 
+	       s->done + (size_t) ((s->head + k) % s->cap) * (DBASE_LEN+1),
+	       (DBASE_LEN+1) * sizeof(int32_t));
+      free(s->done);
+      s->done = tmp;
+      s->cap = cap;
+      s->head = 0;
+    }
+    if(s->ndone == 0)
+      s->first = s->cur;
+    d = s->done + (size_t) ((s->head + s->ndone) % s->cap) * (DBASE_LEN+1);
+    for(k = 0; k <= DBASE_LEN; k++){
+      d[k] = 0;
+      for(j = 0; j < LM_SUB_HIST; j++)
+	d[k] += s->sub[j][k];
+    }
+    memset(s->sub, 0, sizeof(s->sub));
+    s->ndone++;
+    s->cur++;
+  }
+  return 0;
+}
+
+/*
+  Decode and histogram in one pass.
+  Events between two time words are histogrammed into the
+  current slice until one crosses its end, consecutive events 
+  go to different sub-histograms so increments of the same 
+  channel do not wait for each other.
+*/
+int libdbase_lm_spectra_feed(lm_spectra *s, const uint32_t *words, int n){
+  if(s == NULL || (words == NULL && n > 0)){
+    fprintf(stderr, "E: libdbase_lm_spectra_feed(), s or words was NULL\n");
+    return -1;
+  }
+  int k, j = 0;
+  uint32_t off;
+  uint64_t t, end = (s->cur + 1) * s->slice;
+  for(k = 0; k < n; k++){
+    if(words[k] == 0)
+      break;
+    if(words[k] > TS_MASK){
+      s->ts = dbase_lm_unwrap(&s->epoch, &s->last, &s->have_last,
+			      words[k] & TS_MASK);
+      /* Slices start at the first time word, not at device time 0 */
+      if(!s->started){
+	s->cur = s->ts / s->slice;
+	s->started = 1;
+	end = (s->cur + 1) * s->slice;
+      }
+      if(s->ts > s->now)
+	s->now = s->ts;
+      /* Everything before a time word is complete */
+      if(s->now >= end){
+	if(dbase_lm_spectra_close(s, s->now / s->slice) < 0)
+	  return -1;
+	end = (s->cur + 1) * s->slice;
+      }
+      continue;
+    }
+    /* No time word yet, the event can't be timed */
+    if(!s->started){
+      s->late++;
+      continue;
+    }
+    off = words[k] & T_MASK;
+    off -= (off > MAX_T) ? MAX_T : 0;
+    t = s->ts + off;
+    if(t >= end){
+      if(dbase_lm_spectra_close(s, t / s->slice) < 0)
+	return -1;
+      end = (s->cur + 1) * s->slice;
+    }
+    if(t > s->now)
+      s->now = t;
+    if(t < s->cur * s->slice){
+      s->late++;
+      continue;
+    }
+    s->sub[j][(words[k] & A_MASK) >> 21]++;
+    j = (j + 1) & (LM_SUB_HIST - 1);
+  }
+  return 0;
+}
+
+int libdbase_read_lm_spectra(detector *det, lm_spectra *s, uint32_t *words, int len){
+  int n, err;
+  err = libdbase_read_lm_words(det, words, len, &n);
+  if(err < 0)
+    return err;
+  if(libdbase_lm_spectra_feed(s, words, n) < 0)
+    return -1;
+  return err;
+}
+
+int libdbase_lm_spectra_get(lm_spectra *s, int32_t *spec, uint64_t *start){
+  if(s == NULL || spec == NULL){
+    fprintf(stderr, "E: libdbase_lm_spectra_get(), s or spec was NULL\n");
+    return -1;
+  }
+  if(s->ndone == 0)
+    return 0;
+  memcpy(spec, s->done + (size_t) s->head * (DBASE_LEN+1), 
+	 (DBASE_LEN+1) * sizeof(int32_t));
+  if(start != NULL)
+    *start = s->first * s->slice;
+  s->head = (s->head + 1) % s->cap;
+  s->ndone--;
+  s->first++;
+  return 1;
+}
+
+void libdbase_lm_spectra_finish(lm_spectra *s){
+  if(s == NULL || !s->started)
+    return;
+  dbase_lm_spectra_close(s, s->cur + 1);
+}
+
+void libdbase_print_lm_spectrum(const int32_t *spec, uint64_t start, FILE *fh, int binary){
+  if(spec == NULL || fh == NULL){
+    fprintf(stderr, "E: libdbase_print_lm_spectrum(), spec or fh was NULL\n");
+    return;
+  }
+  if(binary){
+    unsigned char b[8];
+    dbase_put_le64(b, start);
+    fwrite(b, 1, 8, fh);
+    dbase_print_file_spectrum_binary(spec, DBASE_LEN + 1, fh);
+  }
+  else{
+    fprintf(fh, "%llu: ", (unsigned long long) start);
+    dbase_print_spectrum_file(spec, DBASE_LEN + 1, fh);
+  }
+}
+
+/*
+  Decode without a device
+*/
+int libdbase_decode_lm_words(const uint32_t *words, int n, pulse *buf, uint32_t *time){
+  if(words == NULL || n < 0 || (buf != NULL && time == NULL)){
+    fprintf(stderr, "E: libdbase_decode_lm_words(), invalid words or time\n");
+    return -1;
+  }
+  if(buf != NULL)
+    return dbase_decode_lm(words, n, buf, time);
+  /* Count only, as in libdbase_read_lm_words() */
+  int k, ts = 0;
+  for(k = 0; k < n && words[k] != 0; k++)
+    ;
+  n = k;
+  for(k = 0; k < n; k++)
+    ts += words[k] >> 31;
+  return n - ts;
+}
+
+/*
+  Synthetic list mode words
+*/
+void libdbase_lm_gen_defaults(lm_gen_cfg *cfg){
+  if(cfg == NULL)
+    return;
+  memset(cfg, 0, sizeof(lm_gen_cfg));
+  cfg->seed = 1;
+  cfg->rate = 10000.0;
+  cfg->peak = 400.0;
+  cfg->sigma = 12.0;
+  cfg->peak_frac = 0.3;
+  cfg->burst_len = 4.0;
+  cfg->burst_gap = 2.0;
+  cfg->rollover = 0.01;
+}
+
+lm_gen *libdbase_lm_gen_new(const lm_gen_cfg *cfg){
+  if(cfg == NULL || cfg->rate <= 0.0){
+    fprintf(stderr, "E: libdbase_lm_gen_new(), rate must be positive\n");
+    return NULL;
+  }
+  lm_gen *g = (lm_gen *) calloc(1, sizeof(lm_gen));
+  if(g == NULL){
+    fprintf(stderr, "E: libdbase_lm_gen_new() unable to allocate memory\n");
+    return NULL;
+  }
+  g->cfg = *cfg;
+  g->s = cfg->seed != 0 ? cfg->seed : 0x9e3779b97f4a7c15ULL;
+  return g;
+}
+
+void libdbase_lm_gen_free(lm_gen *g){
+  free(g);
+}
+
+/* xorshift64*, uniform in (0,1) */
+double dbase_gen_uniform(lm_gen *g){
+  g->s ^= g->s >> 12;
+  g->s ^= g->s << 25;
+  g->s ^= g->s >> 27;
+  return ((g->s * 0x2545f4914f6cdd1dULL >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* Box-Muller (one of the pair) */
+double dbase_gen_normal(lm_gen *g){
+  double u = dbase_gen_uniform(g), v = dbase_gen_uniform(g);
+  return sqrt(-2.0 * log(u)) * cos(6.283185307179586 * v);
+}
+
+int libdbase_lm_gen_words(lm_gen *g, uint32_t *words, int len, uint64_t span, int *events){
+  if(g == NULL || words == NULL || len < 1){
+    fprintf(stderr, "E: libdbase_lm_gen_words(), invalid generator or buffer\n");
+    return -1;
+  }
+  const lm_gen_cfg *c = &g->cfg;
+  int k = 0, ev = 0;
+  uint64_t end = g->t + span;
+  uint32_t off, a;
+  double dt, x;
+  /* Room for a time word, an event and the terminator */
+  while(k < len - 2 && (span == 0 || g->t < end)){
+    /* Time words up to the event */
+    if(g->t >= g->next_ts){
+      words[k++] = 0x80000000u | (uint32_t) (g->next_ts & TS_MASK);
+      g->next_ts += TS_STEP;
+      continue;
+    }
+    /* Event */
+    off = (uint32_t) (g->t - (g->next_ts - TS_STEP));
+    if(off + MAX_T <= T_MASK && off > 0 && dbase_gen_uniform(g) < c->rollover)
+      off += MAX_T;
+    if(dbase_gen_uniform(g) < c->peak_frac)
+      x = c->peak + c->sigma * dbase_gen_normal(g);
+    else
+      x = dbase_gen_uniform(g) * (DBASE_LEN + 1);
+    a = x < 0.0 ? 0 : (x > DBASE_LEN ? DBASE_LEN : (uint32_t) x);
+    /* Word 0 terminates the data, never generate it */
+    if(a == 0 && off == 0)
+      a = 1;
+    words[k++] = (a << 21) | off;
+    ev++;
+
+    /* Next event time */
+    if(g->left > 0){
+      g->left--;
+      dt = -c->burst_gap * log(dbase_gen_uniform(g));
+    }
+    else{
+      if(c->burst > 0.0 && dbase_gen_uniform(g) < c->burst)
+	g->left = (int) (-c->burst_len * log(dbase_gen_uniform(g)) + 0.5);
+      dt = -1e6 / c->rate * log(dbase_gen_uniform(g));
+    }
+    dt += g->frac;
+    g->t += (uint64_t) dt;
+    g->frac = dt - floor(dt);
+  }
+  words[k] = 0;
+  if(events != NULL)
+    *events = ev;
+  return k;
+}
@@ -0,0 +1,1317 @@
+/*
+ * libdbaserhsp.c: Spectrum extensions for libdbaserh
+ * 
+ * Lock-free spectrum snapshots, sliding window spectra, the
+ * spectrum time pyramid, the 64-bit accumulator, energy 
+ * calibration and rebinning, peak tracking, the prefix-sum ROI
+ * registry and the memory-mapped spectrum store.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>     /* error codes */
+#include <fcntl.h>     /* open() */
+#include <math.h>      /* sqrt() */
+#include <stdio.h>     /* printf(), fprintf(), ... */
+#include <stdlib.h>    /* malloc(), calloc(), free(), ... */
+#include <string.h>    /* memcpy() */
+#include <sys/mman.h>  /* mmap(), munmap(), msync() */
+#include <sys/stat.h>  /* fstat() */
+#include <time.h>      /* clock_gettime() */
+#include <unistd.h>    /* ftruncate(), close() */
+
+/* libdbase non-public header */
+#include "libdbaserhi.h"
+
+/*
+  Spectrum snapshots
+*/
+spec_snap *libdbase_snap_new(void){
+  spec_snap *snap = (spec_snap *) calloc(1, sizeof(spec_snap));
+  if(snap == NULL)
+    fprintf(stderr, "E: libdbase_snap_new() unable to allocate memory\n");
+  return snap;
+}
+
+void libdbase_snap_free(spec_snap *snap){
+  free(snap);
+}
+
+int libdbase_set_snap(detector *det, spec_snap *snap){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_snap(), detector was NULL\n");
+    return -1;
+  }
+  det->snap = snap;
+  return 0;
+}
+
+/* 
+   Copy n words with relaxed atomic accesses, so that a racing
+   copy is only a stale value (detected by the sequence number) 
+*/
+static void dbase_snap_copy(int32_t *dst, const int32_t *src, int n){
+  int k;
+  for(k = 0; k < n; k++)
+    __atomic_store_n(dst + k, __atomic_load_n(src + k, __ATOMIC_RELAXED), 
+		     __ATOMIC_RELAXED);
+}
+
+/*
+  Single writer (the thread doing the readouts): write the
+  slot the latest snapshot is not in, then make it the latest
+*/
+void dbase_snap_publish(detector *det){
+  spec_snap *snap = det->snap;
+  uint64_t next = __atomic_load_n(&snap->latest, __ATOMIC_RELAXED) + 1;
+  spec_slot *sl = &snap->slot[next & 1];
+  uint64_t s = __atomic_load_n(&sl->seq, __ATOMIC_RELAXED);
+
+  /* Odd: being written */
+  __atomic_store_n(&sl->seq, s + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&sl->s.seq, next, __ATOMIC_RELAXED);
+  __atomic_store_n(&sl->s.time, libdbase_host_time_us(), __ATOMIC_RELAXED);
+  dbase_snap_copy(sl->s.spec, det->spec, DBASE_LEN + 1);
+  dbase_snap_copy(sl->s.last_spec, det->last_spec, DBASE_LEN + 1);
+  /* Even: done */
+  __atomic_store_n(&sl->seq, s + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&snap->latest, next, __ATOMIC_RELEASE);
+}
+
+uint64_t libdbase_snap_seq(const spec_snap *snap){
+  if(snap == NULL)
+    return 0ULL;
+  return __atomic_load_n(&snap->latest, __ATOMIC_ACQUIRE);
+}
+
+/*
+  Readers retry until they copied a slot that was not
+  written meanwhile (same even slot sequence before and after)
+*/
+int libdbase_snap_read(const spec_snap *snap, spec_snapshot *out){
+  if(snap == NULL || out == NULL){
+    fprintf(stderr, "E: libdbase_snap_read(), snap or out was NULL\n");
+    return -1;
+  }
+  uint64_t latest, s1, s2;
+  const spec_slot *sl;
+  for(;;){
+    latest = __atomic_load_n(&snap->latest, __ATOMIC_ACQUIRE);
+    if(latest == 0ULL)
+      return 1;
+    sl = &snap->slot[latest & 1];
+    s1 = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+    if(s1 & 1)
+      continue;
+    out->seq = __atomic_load_n(&sl->s.seq, __ATOMIC_RELAXED);
+    out->time = __atomic_load_n(&sl->s.time, __ATOMIC_RELAXED);
+    dbase_snap_copy(out->spec, sl->s.spec, DBASE_LEN + 1);
+    dbase_snap_copy(out->last_spec, sl->s.last_spec, DBASE_LEN + 1);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(&sl->seq, __ATOMIC_RELAXED);
+    if(s1 == s2)
+      return 0;
+  }
+}
+
+/*
+  Sliding window spectrum
+*/
+spec_window *libdbase_window_new(int nslots, uint64_t span){
+  if(nslots <= 0){
+    fprintf(stderr, "E: libdbase_window_new(), nslots must be positive\n");
+    return NULL;
+  }
+  spec_window *w = (spec_window *) calloc(1, sizeof(spec_window));
+  if(w == NULL){
+    fprintf(stderr, "E: libdbase_window_new() unable to allocate memory\n");
+    return NULL;
+  }
+  w->ring = (int32_t *) malloc((size_t) nslots * (DBASE_LEN+1) * sizeof(int32_t));
+  w->time = (uint64_t *) malloc(nslots * sizeof(uint64_t));
+  if(w->ring == NULL || w->time == NULL){
+    fprintf(stderr, "E: libdbase_window_new() unable to allocate memory\n");
+    libdbase_window_free(w);
+    return NULL;
+  }
+  w->nslots = nslots;
+  w->span = span;
+  return w;
+}
+
+void libdbase_window_free(spec_window *w){
+  if(w == NULL)
+    return;
+  free(w->ring);
+  free(w->time);
+  free(w);
+}
+
+int libdbase_set_window(detector *det, spec_window *w){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_window(), detector was NULL\n");
+    return -1;
+  }
+  det->win = w;
+  return 0;
+}
+
+void libdbase_window_clear(spec_window *w){
+  if(w == NULL)
+    return;
+  w->head = w->n = 0;
+  memset(w->sum, 0, sizeof(w->sum));
+}
+
+/* Subtract the oldest readout */
+static void dbase_window_drop(spec_window *w){
+  const int32_t *o = w->ring + (size_t) w->head * (DBASE_LEN+1);
+  int k;
+  for(k = 0; k <= DBASE_LEN; k++)
+    w->sum[k] -= o[k];
+  w->head = (w->head + 1) % w->nslots;
+  w->n--;
+}
+
+int libdbase_window_push(spec_window *w, const int32_t *diff, uint64_t time){
+  if(w == NULL || diff == NULL){
+    fprintf(stderr, "E: libdbase_window_push(), w or diff was NULL\n");
+    return -1;
+  }
+  int k;
+  int32_t *d;
+  if(w->n == w->nslots)
+    dbase_window_drop(w);
+  d = w->ring + (size_t) ((w->head + w->n) % w->nslots) * (DBASE_LEN+1);
+  for(k = 0; k <= DBASE_LEN; k++){
+    d[k] = diff[k];
+    w->sum[k] += diff[k];
+  }
+  w->time[(w->head + w->n) % w->nslots] = time;
+  w->n++;
+  /* Readouts before time - span, so the window is span long */
+  while(w->span > 0 && w->n > 1 && time - w->time[w->head] >= w->span)
+    dbase_window_drop(w);
+  return 0;
+}
+
+int libdbase_window_get(const spec_window *w, int32_t *spec, uint64_t *t0, uint64_t *t1){
+  if(w == NULL || spec == NULL){
+    fprintf(stderr, "E: libdbase_window_get(), w or spec was NULL\n");
+    return -1;
+  }
+  int k;
+  for(k = 0; k <= DBASE_LEN; k++)
+    spec[k] = (int32_t) w->sum[k];
+  if(t0 != NULL)
+    *t0 = w->n > 0 ? w->time[w->head] : 0ULL;
+  if(t1 != NULL)
+    *t1 = w->n > 0 ? w->time[(w->head + w->n - 1) % w->nslots] : 0ULL;
+  return w->n;
+}
+
+/*
+  Spectrum time pyramid
+*/
+spec_pyramid *libdbase_pyramid_new(const uint64_t *dur, int nlev, int cap){
+  if(dur == NULL || nlev <= 0 || nlev > PYR_MAX_LEVELS || cap <= 0){
+    fprintf(stderr, "E: libdbase_pyramid_new(), need 1..%d levels and cap > 0\n",
+	    PYR_MAX_LEVELS);
+    return NULL;
+  }
+  spec_pyramid *p = (spec_pyramid *) calloc(1, sizeof(spec_pyramid));
+  if(p == NULL){
+    fprintf(stderr, "E: libdbase_pyramid_new() unable to allocate memory\n");
+    return NULL;
+  }
+  int k;
+  p->nlev = nlev;
+  p->cap = cap;
+  for(k = 0; k < nlev; k++){
+    pyr_level *l = &p->lev[k];
+    l->dur = dur[k];
+    l->spec = (int32_t *) malloc((size_t) cap * (DBASE_LEN+1) * sizeof(int32_t));
+    l->t0 = (uint64_t *) malloc(5 * (size_t) cap * sizeof(uint64_t));
+    if(l->spec == NULL || l->t0 == NULL){
+      fprintf(stderr, "E: libdbase_pyramid_new() unable to allocate memory\n");
+      libdbase_pyramid_free(p);
+      return NULL;
+    }
+    l->t1 = l->t0 + cap;
+    l->s0 = l->t1 + cap;
+    l->s1 = l->s0 + cap;
+    l->id = l->s1 + cap;
+  }
+  return p;
+}
+
+void libdbase_pyramid_free(spec_pyramid *p){
+  if(p == NULL)
+    return;
+  int k;
+  for(k = 0; k < p->nlev; k++){
+    free(p->lev[k].spec);
+    free(p->lev[k].t0);
+  }
+  free(p);
+}
+
+int libdbase_set_pyramid(detector *det, spec_pyramid *p){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_pyramid(), detector was NULL\n");
+    return -1;
+  }
+  det->pyr = p;
+  return 0;
+}
+
+void libdbase_pyramid_clear(spec_pyramid *p){
+  if(p == NULL)
+    return;
+  int k;
+  for(k = 0; k < p->nlev; k++)
+    p->lev[k].head = p->lev[k].n = 0;
+  p->seq = 0;
+  p->last = 0;
+}
+
+int libdbase_pyramid_push(spec_pyramid *p, const int32_t *diff, uint64_t time){
+  if(p == NULL || diff == NULL){
+    fprintf(stderr, "E: libdbase_pyramid_push(), p or diff was NULL\n");
+    return -1;
+  }
+  /* The readout spans from the previous one */
+  uint64_t start = (p->seq > 0 && p->last <= time) ? p->last : time;
+  int k, i, j;
+  for(k = 0; k < p->nlev; k++){
+    pyr_level *l = &p->lev[k];
+    uint64_t id = l->dur > 0 ? time / l->dur : p->seq;
+    int32_t *d;
+    i = (l->head + l->n - 1) % p->cap;
+    if(l->n > 0 && l->id[i] == id){
+      /* Same bucket, add to the newest node */
+      d = l->spec + (size_t) i * (DBASE_LEN+1);
+      for(j = 0; j <= DBASE_LEN; j++)
+	d[j] += diff[j];
+      l->t1[i] = time;
+      l->s1[i] = p->seq;
+      continue;
+    }
+    /* New node, replacing the oldest if full */
+    if(l->n == p->cap)
+      l->head = (l->head + 1) % p->cap;
+    else
+      l->n++;
+    i = (l->head + l->n - 1) % p->cap;
+    memcpy(l->spec + (size_t) i * (DBASE_LEN+1), diff, (DBASE_LEN+1) * sizeof(int32_t));
+    l->t0[i] = start;
+    l->t1[i] = time;
+    l->s0[i] = l->s1[i] = p->seq;
+    l->id[i] = id;
+  }
+  p->seq++;
+  p->last = time;
+  return 0;
+}
+
+/*
+  Sum the nodes of level k and below within [t0, t1] and 
+  readouts s0..s1: the contained nodes of a level are 
+  consecutive, the readouts left on either side of them
+  are taken from the finer levels.
+*/
+static int dbase_pyramid_cover(const spec_pyramid *p, int k, uint64_t t0, uint64_t t1,
+			       uint64_t s0, uint64_t s1, int64_t *spec,
+			       uint64_t *c0, uint64_t *c1){
+  if(k < 0 || s0 > s1)
+    return 0;
+  const pyr_level *l = &p->lev[k];
+  int m, i, first = -1, last = -1, used = 0;
+  for(m = 0; m < l->n; m++){
+    i = (l->head + m) % p->cap;
+    if(l->t0[i] >= t0 && l->t1[i] <= t1 && l->s0[i] >= s0 && l->s1[i] <= s1){
+      if(first < 0)
+	first = i;
+      last = i;
+      used++;
+    }
+  }
+  if(first < 0)
+    return dbase_pyramid_cover(p, k - 1, t0, t1, s0, s1, spec, c0, c1);
+  for(m = first; ; m = (m + 1) % p->cap){
+    const int32_t *d = l->spec + (size_t) m * (DBASE_LEN+1);
+    for(i = 0; i <= DBASE_LEN; i++)
+      spec[i] += d[i];
+    if(m == last)
+      break;
+  }
+  if(l->t0[first] < *c0)
+    *c0 = l->t0[first];
+  if(l->t1[last] > *c1)
+    *c1 = l->t1[last];
+  if(l->s0[first] > s0)
+    used += dbase_pyramid_cover(p, k - 1, t0, t1, s0, l->s0[first] - 1, spec, c0, c1);
+  if(l->s1[last] < s1)
+    used += dbase_pyramid_cover(p, k - 1, t0, t1, l->s1[last] + 1, s1, spec, c0, c1);
+  return used;
+}
+
+int libdbase_pyramid_query(const spec_pyramid *p, uint64_t t0, uint64_t t1, 
+			   int64_t *spec, uint64_t *c0, uint64_t *c1){
+  if(p == NULL || spec == NULL){
+    fprintf(stderr, "E: libdbase_pyramid_query(), p or spec was NULL\n");
+    return -1;
+  }
+  uint64_t a = UINT64_MAX, b = 0;
+  int used;
+  memset(spec, 0, (DBASE_LEN+1) * sizeof(int64_t));
+  used = p->seq > 0 ? dbase_pyramid_cover(p, p->nlev - 1, t0, t1, 0, p->seq - 1, 
+					  spec, &a, &b) : 0;
+  if(c0 != NULL)
+    *c0 = a;
+  if(c1 != NULL)
+    *c1 = b;
+  return used;
+}
+
+/*
+  64-bit spectrum accumulator
+*/
+uint64_t dbase_wall_time_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+spec_accum *libdbase_accum_new(void){
+  spec_accum *acc = (spec_accum *) calloc(1, sizeof(spec_accum));
+  if(acc == NULL){
+    fprintf(stderr, "E: libdbase_accum_new() unable to allocate memory\n");
+    return NULL;
+  }
+  acc->epoch = dbase_wall_time_us();
+  return acc;
+}
+
+void libdbase_accum_free(spec_accum *acc){
+  free(acc);
+}
+
+int libdbase_set_accum(detector *det, spec_accum *acc){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_accum(), detector was NULL\n");
+    return -1;
+  }
+  /* Device counters are unknown until the next readout */
+  if(acc != NULL)
+    acc->have_prev = 0;
+  det->acc = acc;
+  return 0;
+}
+
+void dbase_accum_cleared(spec_accum *acc){
+  memset(acc->prev, 0, sizeof(acc->prev));
+  acc->have_prev = 1;
+  acc->resets++;
+}
+
+int libdbase_accum_feed(spec_accum *acc, const int32_t *spec){
+  if(acc == NULL || spec == NULL){
+    fprintf(stderr, "E: libdbase_accum_feed(), acc or spec was NULL\n");
+    return -1;
+  }
+  int k, cleared = 0;
+  uint32_t c, d;
+  if(!acc->have_prev){
+    memcpy(acc->prev, spec, sizeof(acc->prev));
+    acc->have_prev = 1;
+    return 0;
+  }
+  for(k = 0; k <= DBASE_LEN; k++){
+    c = (uint32_t) spec[k];
+    d = c - acc->prev[k];
+    if(d >= 0x80000000u){
+      /* Cleared behind our back */
+      d = c;
+      cleared = 1;
+    }
+    acc->sum[k] += d;
+    acc->prev[k] = c;
+  }
+  acc->resets += cleared;
+  return 0;
+}
+
+void libdbase_accum_reset(spec_accum *acc, uint64_t epoch){
+  if(acc == NULL)
+    return;
+  memset(acc->sum, 0, sizeof(acc->sum));
+  acc->epoch = epoch > 0 ? epoch : dbase_wall_time_us();
+  acc->resets = 0;
+}
+
+uint64_t libdbase_accum_get(const spec_accum *acc, uint64_t *spec, uint64_t *epoch){
+  if(acc == NULL)
+    return 0;
+  uint64_t tot = 0;
+  int k;
+  for(k = 0; k <= DBASE_LEN; k++)
+    tot += acc->sum[k];
+  if(spec != NULL)
+    memcpy(spec, acc->sum, sizeof(acc->sum));
+  if(epoch != NULL)
+    *epoch = acc->epoch;
+  return tot;
+}
+
+/*
+  File: magic, epoch, resets and the sums as LE 64-bit fields.
+  The device baseline is not saved, a loaded accumulator takes
+  it on its first readout.
+*/
+int libdbase_accum_save(const spec_accum *acc, const char *path){
+  if(acc == NULL || path == NULL){
+    fprintf(stderr, "E: libdbase_accum_save(), acc or path was NULL\n");
+    return -1;
+  }
+  unsigned char buf[8 * (DBASE_LEN + 4)];
+  int k;
+  FILE *fh;
+  memcpy(buf, ACCUM_MAGIC, 8);
+  dbase_put_le64(buf + 8, acc->epoch);
+  dbase_put_le64(buf + 16, acc->resets);
+  for(k = 0; k <= DBASE_LEN; k++)
+    dbase_put_le64(buf + 24 + 8 * k, acc->sum[k]);
+  if((fh = fopen(path, "wb")) == NULL){
+    fprintf(stderr, "E: libdbase_accum_save() unable to open %s, errno=%d\n", path, errno);
+    return -errno;
+  }
+  k = fwrite(buf, sizeof(buf), 1, fh) == 1;
+  if(fclose(fh) != 0 || !k){
+    fprintf(stderr, "E: libdbase_accum_save() when writing %s\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+spec_accum *libdbase_accum_load(const char *path){
+  if(path == NULL){
+    fprintf(stderr, "E: libdbase_accum_load(), path was NULL\n");
+    return NULL;
+  }
+  unsigned char buf[8 * (DBASE_LEN + 4)];
+  spec_accum *acc;
+  int k, ok;
+  FILE *fh = fopen(path, "rb");
+  if(fh == NULL){
+    fprintf(stderr, "E: libdbase_accum_load() unable to open %s, errno=%d\n", path, errno);
+    return NULL;
+  }
+  ok = fread(buf, sizeof(buf), 1, fh) == 1 && memcmp(buf, ACCUM_MAGIC, 8) == 0;
+  fclose(fh);
+  if(!ok){
+    fprintf(stderr, "E: libdbase_accum_load(), %s is not an accumulator file\n", path);
+    return NULL;
+  }
+  if((acc = libdbase_accum_new()) == NULL)
+    return NULL;
+  acc->epoch = dbase_get_le64(buf + 8);
+  acc->resets = dbase_get_le64(buf + 16);
+  for(k = 0; k <= DBASE_LEN; k++)
+    acc->sum[k] = dbase_get_le64(buf + 24 + 8 * k);
+  return acc;
+}
+
+/*
+  Energy calibration and rebinning
+*/
+double libdbase_calib_energy(const spec_calib *cal, double x){
+  double e = 0.0;
+  int k;
+  for(k = cal->ncoef - 1; k >= 0; k--)
+    e = e * x + cal->coef[k];
+  return e;
+}
+
+void libdbase_calib_free(spec_calib *cal){
+  if(cal == NULL)
+    return;
+  free(cal->ch);
+  free(cal->w);
+  free(cal->out);
+  free(cal);
+}
+
+/*
+  Bin m (lo..hi) takes from channel k (edges E(k-0.5)..E(k+0.5))
+  the fraction of the channel inside the bin. The channels of a
+  bin are consecutive as E is increasing. Returns the number of
+  channels from *first (moved to the first one of bin m), weights
+  are written to w unless NULL.
+*/
+static int dbase_calib_row(const spec_calib *cal, const double *edge, int m, 
+			   int *first, double *w){
+  double lo = cal->e0 + (cal->e1 - cal->e0) * m / cal->nbins;
+  double hi = cal->e0 + (cal->e1 - cal->e0) * (m + 1) / cal->nbins;
+  double a, b;
+  int k;
+  while(*first <= DBASE_LEN && edge[*first + 1] <= lo)
+    (*first)++;
+  for(k = *first; k <= DBASE_LEN && edge[k] < hi; k++){
+    a = edge[k] > lo ? edge[k] : lo;
+    b = edge[k + 1] < hi ? edge[k + 1] : hi;
+    if(w != NULL)
+      w[k - *first] = (b - a) / (edge[k + 1] - edge[k]);
+  }
+  return k - *first;
+}
+
+spec_calib *libdbase_calib_new(const double *coef, int ncoef, 
+			       double e0, double e1, int nbins){
+  if(coef == NULL || ncoef <= 0 || ncoef > CALIB_MAX_COEF || nbins <= 0 || !(e1 > e0)){
+    fprintf(stderr, "E: libdbase_calib_new(), invalid coefficients or grid\n");
+    return NULL;
+  }
+  spec_calib *cal = (spec_calib *) calloc(1, sizeof(spec_calib));
+  double edge[DBASE_LEN+2];
+  int k, m, first, nw;
+  if(cal == NULL){
+    fprintf(stderr, "E: libdbase_calib_new() unable to allocate memory\n");
+    return NULL;
+  }
+  memcpy(cal->coef, coef, ncoef * sizeof(double));
+  cal->ncoef = ncoef;
+  cal->e0 = e0;
+  cal->e1 = e1;
+  cal->nbins = nbins;
+  for(k = 0; k <= DBASE_LEN + 1; k++){
+    edge[k] = libdbase_calib_energy(cal, k - 0.5);
+    if(k > 0 && !(edge[k] > edge[k-1])){
+      fprintf(stderr, "E: libdbase_calib_new(), energy not increasing at channel %d\n", k);
+      libdbase_calib_free(cal);
+      return NULL;
+    }
+  }
+  cal->ch = (int *) malloc(3 * (size_t) nbins * sizeof(int));
+  cal->out = (double *) calloc(nbins, sizeof(double));
+  if(cal->ch == NULL || cal->out == NULL){
+    fprintf(stderr, "E: libdbase_calib_new() unable to allocate memory\n");
+    libdbase_calib_free(cal);
+    return NULL;
+  }
+  cal->off = cal->ch + nbins;
+  cal->n = cal->off + nbins;
+  /* Row sizes, padded to chunks of 4, then the weights */
+  for(m = 0, first = 0, nw = 0; m < nbins; m++){
+    cal->n[m] = (dbase_calib_row(cal, edge, m, &first, NULL) + 3) / 4;
+    cal->ch[m] = first;
+    cal->off[m] = nw;
+    nw += 4 * cal->n[m];
+  }
+  if((cal->w = (double *) calloc(nw > 0 ? nw : 1, sizeof(double))) == NULL){
+    fprintf(stderr, "E: libdbase_calib_new() unable to allocate memory\n");
+    libdbase_calib_free(cal);
+    return NULL;
+  }
+  for(m = 0, first = 0; m < nbins; m++)
+    dbase_calib_row(cal, edge, m, &first, cal->w + cal->off[m]);
+  return cal;
+}
+
+int libdbase_set_calib(detector *det, spec_calib *cal){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_calib(), detector was NULL\n");
+    return -1;
+  }
+  det->cal = cal;
+  return 0;
+}
+
+#if defined(__GNUC__)
+typedef double dbase_v4d __attribute__ ((vector_size (32)));
+#endif
+
+/* Rebinning kernel, channels are converted once, zero padded */
+static int dbase_calib_apply(const spec_calib *cal, const int32_t *spec, double *out, int add){
+  if(cal == NULL || spec == NULL || out == NULL){
+    fprintf(stderr, "E: libdbase_calib_rebin(), cal, spec or out was NULL\n");
+    return -1;
+  }
+  double x[DBASE_LEN + 1 + 4 * 2];
+  int m, j, k;
+  for(k = 0; k <= DBASE_LEN; k++)
+    x[k] = (double) spec[k];
+  for(; k < DBASE_LEN + 1 + 4 * 2; k++)
+    x[k] = 0.0;
+  for(m = 0; m < cal->nbins; m++){
+    const double *w = cal->w + cal->off[m], *v = x + cal->ch[m];
+    double s;
+#if defined(__GNUC__)
+    dbase_v4d acc = {0.0, 0.0, 0.0, 0.0}, vw, vx;
+    for(j = 0; j < cal->n[m]; j++){
+      memcpy(&vw, w + 4 * j, sizeof(vw));
+      memcpy(&vx, v + 4 * j, sizeof(vx));
+      acc += vw * vx;
+    }
+    s = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#else
+    s = 0.0;
+    for(j = 0; j < 4 * cal->n[m]; j++)
+      s += w[j] * v[j];
+#endif
+    out[m] = add ? out[m] + s : s;
+  }
+  return cal->nbins;
+}
+
+int libdbase_calib_rebin(const spec_calib *cal, const int32_t *spec, double *out){
+  return dbase_calib_apply(cal, spec, out, 0);
+}
+
+int libdbase_calib_rebin_add(const spec_calib *cal, const int32_t *spec, double *out){
+  return dbase_calib_apply(cal, spec, out, 1);
+}
+
+const double *libdbase_calib_get(const spec_calib *cal, int *nbins){
+  if(cal == NULL)
+    return NULL;
+  if(nbins != NULL)
+    *nbins = cal->nbins;
+  return cal->out;
+}
+
+/*
+  Peak search and tracking
+*/
+spec_peaks *libdbase_peaks_new(double thresh, int smooth, double rescan){
+  if(thresh <= 0.0 || smooth < 0 || smooth > PEAK_MAX_SMOOTH || rescan < 0.0){
+    fprintf(stderr, "E: libdbase_peaks_new(), need thresh > 0, smooth 0..%d, rescan >= 0\n",
+	    PEAK_MAX_SMOOTH);
+    return NULL;
+  }
+  spec_peaks *pk = (spec_peaks *) calloc(1, sizeof(spec_peaks));
+  int k, j;
+  if(pk == NULL){
+    fprintf(stderr, "E: libdbase_peaks_new() unable to allocate memory\n");
+    return NULL;
+  }
+  pk->thresh = thresh;
+  pk->smooth = smooth;
+  pk->rescan = rescan;
+  /* Filter: (1 2 1)/4 smooth times, then (1 -2 1) */
+  pk->nh = 3;
+  pk->h[0] = 1.0;
+  pk->h[1] = -2.0;
+  pk->h[2] = 1.0;
+  for(k = 0; k < smooth; k++){
+    for(j = pk->nh + 1; j >= 0; j--)
+      pk->h[j] = 0.25 * ((j >= 2 ? pk->h[j-2] : 0.0) + 
+			 2.0 * (j >= 1 && j <= pk->nh ? pk->h[j-1] : 0.0) +
+			 (j < pk->nh ? pk->h[j] : 0.0));
+    pk->nh += 2;
+  }
+  for(j = 0; j < pk->nh; j++)
+    pk->h2[j] = pk->h[j] * pk->h[j];
+  return pk;
+}
+
+void libdbase_peaks_free(spec_peaks *pk){
+  free(pk);
+}
+
+int libdbase_set_peaks(detector *det, spec_peaks *pk){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_peaks(), detector was NULL\n");
+    return -1;
+  }
+  det->peaks = pk;
+  return 0;
+}
+
+/* out[k] = sum_j h[j] x[k + j], k = 0..n-1 (rounded up to 4) */
+static void dbase_peaks_conv(const double *x, const double *h, int nh, double *out, int n){
+  int k, j;
+#if defined(__GNUC__)
+  dbase_v4d acc, vx;
+  for(k = 0; k < n; k += 4){
+    acc = (dbase_v4d) {0.0, 0.0, 0.0, 0.0};
+    for(j = 0; j < nh; j++){
+      memcpy(&vx, x + k + j, sizeof(vx));
+      acc += h[j] * vx;
+    }
+    memcpy(out + k, &acc, sizeof(acc));
+  }
+#else
+  for(k = 0; k < n; k++){
+    out[k] = 0.0;
+    for(j = 0; j < nh; j++)
+      out[k] += h[j] * x[k + j];
+  }
+#endif
+}
+
+/*
+  Net counts, centroid and fwhm in lo..hi over a linear 
+  background through the mean of 3 channels on each side
+*/
+#define PEAK_BG 3
+static int dbase_peak_eval(const int32_t *spec, int lo, int hi, peak_info *p){
+  double bl = 0.0, br = 0.0, nl = 0.0, nr = 0.0, b, y, s0 = 0.0, s1 = 0.0, s2 = 0.0;
+  double gross = 0.0, bsum = 0.0, c, xl, xr, sb, w;
+  int k;
+  if(lo < 1)
+    lo = 1;
+  if(hi > DBASE_LEN - 1)
+    hi = DBASE_LEN - 1;
+  if(hi - lo < 2)
+    return -1;
+  for(k = lo - PEAK_BG; k < lo; k++)
+    if(k >= 0){
+      bl += spec[k];
+      nl++;
+    }
+  for(k = hi + 1; k <= hi + PEAK_BG; k++)
+    if(k <= DBASE_LEN){
+      br += spec[k];
+      nr++;
+    }
+  sb = bl + br;
+  bl /= nl;
+  br /= nr;
+  xl = lo - (nl + 1.0) / 2.0;
+  xr = hi + (nr + 1.0) / 2.0;
+  for(k = lo; k <= hi; k++){
+    b = bl + (br - bl) * (k - xl) / (xr - xl);
+    y = spec[k] - b;
+    gross += spec[k];
+    bsum += b;
+    s0 += y;
+    s1 += y * k;
+    s2 += y * k * k;
+  }
+  if(s0 <= 0.0)
+    return -1;
+  c = s1 / s0;
+  p->centroid = c;
+  p->fwhm = 2.3548 * sqrt(s2 / s0 - c * c > 0.0 ? s2 / s0 - c * c : 0.0);
+  p->net = s0;
+  p->bg = bsum;
+  /* Background scaled from the sb counts in nl + nr channels, as in libdbase_roi_eval() */
+  w = hi - lo + 1;
+  p->err = sqrt(gross + sb * (w / (nl + nr)) * (w / (nl + nr)));
+  p->lo = (uint) lo;
+  p->hi = (uint) hi;
+  return 0;
+}
+
+/* Re-evaluate p within 3 sigma of its centroid */
+static int dbase_peak_track(const int32_t *spec, peak_info *p){
+  int hw = (int) (1.274 * p->fwhm + 0.5);
+  if(hw < 3)
+    hw = 3;
+  return dbase_peak_eval(spec, (int) (p->centroid + 0.5) - hw, (int) (p->centroid + 0.5) + hw, p);
+}
+
+int libdbase_peaks_scan(spec_peaks *pk, const int32_t *spec){
+  if(pk == NULL || spec == NULL){
+    fprintf(stderr, "E: libdbase_peaks_scan(), pk or spec was NULL\n");
+    return -1;
+  }
+  peak_info found[PEAK_MAX], p;
+  double sig[PEAK_MAX], s;
+  const double *dd = pk->dd, *var = pk->var;
+  int k, j, l, r, nf = 0, c = (pk->nh - 1) / 2, edge = c + PEAK_BG + 1;
+  int64_t tot = 0;
+  for(k = 0; k <= DBASE_LEN; k++){
+    pk->y[PEAK_PAD + k] = (double) spec[k];
+    tot += spec[k];
+  }
+  /* dd[k] and its variance, centered on channel k */
+  dbase_peaks_conv(pk->y + PEAK_PAD - c, pk->h, pk->nh, pk->dd, DBASE_LEN + 1);
+  dbase_peaks_conv(pk->y + PEAK_PAD - c, pk->h2, pk->nh, pk->var, DBASE_LEN + 1);
+  for(k = edge; k <= DBASE_LEN - edge; k++){
+    if(!(dd[k] < 0.0 && dd[k] <= dd[k-1] && dd[k] < dd[k+1]))
+      continue;
+    s = -dd[k] / sqrt(var[k] > 1.0 ? var[k] : 1.0);
+    if(s < pk->thresh)
+      continue;
+    /* Negative second difference spans about +-1 sigma */
+    for(l = k; l > 0 && dd[l-1] < 0.0; l--);
+    for(r = k; r < DBASE_LEN && dd[r+1] < 0.0; r++);
+    memset(&p, 0, sizeof(p));
+    if(dbase_peak_eval(spec, k - (3 * (r - l + 1)) / 2, k + (3 * (r - l + 1)) / 2, &p) < 0 ||
+       dbase_peak_track(spec, &p) < 0)
+      continue;
+    /* Same peak as one found already (keep the more significant) */
+    for(j = 0; j < nf; j++)
+      if(fabs(found[j].centroid - p.centroid) < 0.5 * (p.fwhm > 2.0 ? p.fwhm : 2.0))
+	break;
+    if(j < nf){
+      if(sig[j] < s){
+	found[j] = p;
+	sig[j] = s;
+      }
+      continue;
+    }
+    if(nf == PEAK_MAX){
+      /* Full, replace the least significant */
+      for(j = 0, l = 1; l < nf; l++)
+	if(sig[l] < sig[j])
+	  j = l;
+      if(sig[j] >= s)
+	continue;
+      memmove(found + j, found + j + 1, (nf - j - 1) * sizeof(peak_info));
+      memmove(sig + j, sig + j + 1, (nf - j - 1) * sizeof(double));
+      nf--;
+    }
+    found[nf] = p;
+    sig[nf++] = s;
+  }
+  /* Keep the ids of peaks found again */
+  for(j = 0; j < nf; j++){
+    found[j].id = -1;
+    for(l = 0; l < pk->n; l++)
+      if(pk->peak[l].id >= 0 && fabs(pk->peak[l].centroid - found[j].centroid) <
+	 (pk->peak[l].fwhm > 2.0 ? pk->peak[l].fwhm : 2.0)){
+	found[j].id = pk->peak[l].id;
+	pk->peak[l].id = -1;
+	break;
+      }
+  }
+  for(j = 0; j < nf; j++)
+    if(found[j].id < 0)
+      found[j].id = pk->next_id++;
+  memcpy(pk->peak, found, nf * sizeof(peak_info));
+  pk->n = nf;
+  pk->at_scan = tot;
+  pk->since = 0;
+  return nf;
+}
+
+int libdbase_peaks_update(spec_peaks *pk, const int32_t *spec, const int32_t *diff){
+  if(pk == NULL || spec == NULL || diff == NULL){
+    fprintf(stderr, "E: libdbase_peaks_update(), pk, spec or diff was NULL\n");
+    return -1;
+  }
+  int64_t d = 0, tot = 0;
+  int k, n;
+  for(k = 0; k <= DBASE_LEN; k++){
+    d += diff[k];
+    tot += spec[k];
+  }
+  pk->since += d;
+  /* Enough new counts, or cleared */
+  if(tot < pk->at_scan || (tot >= PEAK_MIN_COUNTS && 
+			   pk->since >= pk->rescan * (pk->at_scan > PEAK_MIN_COUNTS ? 
+						      pk->at_scan : PEAK_MIN_COUNTS))){
+    libdbase_peaks_scan(pk, spec);
+    return 1;
+  }
+  /* Track, dropping peaks that vanished */
+  for(k = 0, n = 0; k < pk->n; k++)
+    if(dbase_peak_track(spec, &pk->peak[k]) == 0)
+      pk->peak[n++] = pk->peak[k];
+  pk->n = n;
+  return 0;
+}
+
+int libdbase_peaks_get(const spec_peaks *pk, peak_info *out, int len){
+  if(pk == NULL || out == NULL){
+    fprintf(stderr, "E: libdbase_peaks_get(), pk or out was NULL\n");
+    return -1;
+  }
+  if(len > pk->n)
+    len = pk->n;
+  if(len > 0)
+    memcpy(out, pk->peak, len * sizeof(peak_info));
+  return len > 0 ? len : 0;
+}
+
+/*
+  ROI registry
+*/
+roi_set *libdbase_roi_new(void){
+  roi_set *rs = (roi_set *) calloc(1, sizeof(roi_set));
+  if(rs == NULL)
+    fprintf(stderr, "E: libdbase_roi_new() unable to allocate memory\n");
+  return rs;
+}
+
+void libdbase_roi_free(roi_set *rs){
+  if(rs == NULL)
+    return;
+  free(rs->roi);
+  free(rs);
+}
+
+int libdbase_roi_add(roi_set *rs, uint lo, uint hi, uint bg){
+  if(rs == NULL || lo > hi || hi > DBASE_LEN){
+    fprintf(stderr, "E: libdbase_roi_add(), invalid registry or channels %u:%u\n", lo, hi);
+    return -1;
+  }
+  if(rs->n == rs->cap){
+    int cap = rs->cap == 0 ? 16 : 2 * rs->cap;
+    roi_def *tmp = (roi_def *) realloc(rs->roi, cap * sizeof(roi_def));
+    if(tmp == NULL){
+      fprintf(stderr, "E: libdbase_roi_add() unable to allocate memory\n");
+      return -ENOMEM;
+    }
+    rs->roi = tmp;
+    rs->cap = cap;
+  }
+  rs->roi[rs->n].lo = lo;
+  rs->roi[rs->n].hi = hi;
+  rs->roi[rs->n].bg = bg;
+  return rs->n++;
+}
+
+int libdbase_roi_count(const roi_set *rs){
+  return rs == NULL ? 0 : rs->n;
+}
+
+int libdbase_set_rois(detector *det, roi_set *rs){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_set_rois(), detector was NULL\n");
+    return -1;
+  }
+  det->rois = rs;
+  if(rs != NULL)
+    libdbase_roi_update(rs, det->spec);
+  return 0;
+}
+
+int libdbase_roi_update(roi_set *rs, const int32_t *spec){
+  if(rs == NULL || spec == NULL){
+    fprintf(stderr, "E: libdbase_roi_update(), rs or spec was NULL\n");
+    return -1;
+  }
+  int k;
+  int64_t s = 0;
+  rs->prefix[0] = 0;
+  for(k = 0; k <= DBASE_LEN; k++){
+    s += spec[k];
+    rs->prefix[k+1] = s;
+  }
+  return 0;
+}
+
+int64_t libdbase_roi_sum(const roi_set *rs, uint lo, uint hi){
+  if(rs == NULL || lo > hi || hi > DBASE_LEN)
+    return 0;
+  return rs->prefix[hi + 1] - rs->prefix[lo];
+}
+
+/*
+  Background: mean of the bg channels below and above the ROI
+  (fewer at the spectrum ends), times the ROI width
+*/
+int libdbase_roi_eval(const roi_set *rs, int idx, roi_result *res){
+  if(rs == NULL || res == NULL || idx < 0 || idx >= rs->n){
+    fprintf(stderr, "E: libdbase_roi_eval(), invalid registry, index or result\n");
+    return -1;
+  }
+  const roi_def *r = &rs->roi[idx];
+  const int64_t *p = rs->prefix;
+  double w = (double) (r->hi - r->lo + 1), bsum = 0.0, bn = 0.0;
+  uint nl, nh;
+  res->gross = p[r->hi + 1] - p[r->lo];
+  res->bg = 0.0;
+  if(r->bg > 0){
+    nl = r->lo < r->bg ? r->lo : r->bg;
+    nh = DBASE_LEN - r->hi < r->bg ? DBASE_LEN - r->hi : r->bg;
+    if(nl > 0){
+      bsum += (double) (p[r->lo] - p[r->lo - nl]);
+      bn += nl;
+    }
+    if(nh > 0){
+      bsum += (double) (p[r->hi + 1 + nh] - p[r->hi + 1]);
+      bn += nh;
+    }
+    if(bn > 0.0)
+      res->bg = bsum / bn * w;
+  }
+  res->net = (double) res->gross - res->bg;
+  res->err = sqrt((double) (res->gross > 0 ? res->gross : 0) + 
+		  (bn > 0.0 ? bsum * (w / bn) * (w / bn) : 0.0));
+  return 0;
+}
+
+int libdbase_roi_eval_all(const roi_set *rs, roi_result *res, int len){
+  if(rs == NULL || res == NULL){
+    fprintf(stderr, "E: libdbase_roi_eval_all(), rs or res was NULL\n");
+    return -1;
+  }
+  int k;
+  if(len > rs->n)
+    len = rs->n;
+  for(k = 0; k < len; k++)
+    libdbase_roi_eval(rs, k, res + k);
+  return len;
+}
+
+/*
+  Spectrum store
+*/
+static int dbase_map_open(store_map *m, const char *path, int rw){
+  struct stat sb;
+  m->base = NULL;
+  m->size = 0;
+  m->fd = open(path, rw ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if(m->fd < 0 || fstat(m->fd, &sb) < 0){
+    fprintf(stderr, "E: libdbase_store_open() unable to open %s, errno=%d\n", path, errno);
+    return -errno;
+  }
+  m->size = (size_t) sb.st_size;
+  if(m->size > 0){
+    m->base = (unsigned char *) mmap(NULL, m->size, rw ? PROT_READ | PROT_WRITE : PROT_READ,
+				     MAP_SHARED, m->fd, 0);
+    if(m->base == MAP_FAILED){
+      m->base = NULL;
+      fprintf(stderr, "E: libdbase_store_open() unable to map %s, errno=%d\n", path, errno);
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+/* Resize file and mapping to size bytes */
+static int dbase_map_resize(store_map *m, size_t size){
+  if(m->base != NULL)
+    munmap(m->base, m->size);
+  m->base = NULL;
+  if(ftruncate(m->fd, (off_t) size) < 0){
+    fprintf(stderr, "E: dbase_map_resize() unable to grow file, errno=%d\n", errno);
+    return -errno;
+  }
+  m->size = size;
+  m->base = (unsigned char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+  if(m->base == MAP_FAILED){
+    m->base = NULL;
+    fprintf(stderr, "E: dbase_map_resize() unable to map file, errno=%d\n", errno);
+    return -errno;
+  }
+  return 0;
+}
+
+static void dbase_map_close(store_map *m){
+  if(m->base != NULL)
+    munmap(m->base, m->size);
+  if(m->fd >= 0)
+    close(m->fd);
+  m->base = NULL;
+  m->fd = -1;
+}
+
+/* Map room for cap records (and index entries) */
+static int dbase_store_grow(spec_store *st, uint64_t cap){
+  int err;
+  if((err = dbase_map_resize(&st->data, STORE_HDR_SIZE + cap * sizeof(spec_record))) < 0 ||
+     (err = dbase_map_resize(&st->idx, cap * sizeof(uint64_t))) < 0)
+    return err;
+  st->hdr = (store_hdr *) st->data.base;
+  st->time = (uint64_t *) st->idx.base;
+  st->cap = cap;
+  return 0;
+}
+
+/* Records readable, a reader only sees what it has mapped */
+static inline uint64_t dbase_store_n(const spec_store *st){
+  uint64_t n = st->hdr->count;
+  if(n > st->cap)
+    n = st->cap;
+  if(n > st->idx.size / sizeof(uint64_t))
+    n = st->idx.size / sizeof(uint64_t);
+  return n;
+}
+
+static inline const spec_record *dbase_store_rec(const spec_store *st, uint64_t k){
+  return (const spec_record *) (st->data.base + STORE_HDR_SIZE) + k;
+}
+
+spec_store *libdbase_store_open(const char *path, int rw){
+  if(path == NULL){
+    fprintf(stderr, "E: libdbase_store_open(), path was NULL\n");
+    return NULL;
+  }
+  spec_store *st = (spec_store *) calloc(1, sizeof(spec_store));
+  char *ipath = (char *) malloc(strlen(path) + 5);
+  uint64_t k, n, have;
+  if(st == NULL || ipath == NULL){
+    fprintf(stderr, "E: libdbase_store_open() unable to allocate memory\n");
+    free(st);
+    free(ipath);
+    return NULL;
+  }
+  st->rw = rw;
+  st->data.fd = st->idx.fd = -1;
+  sprintf(ipath, "%s.idx", path);
+  if(dbase_map_open(&st->data, path, rw) < 0 || dbase_map_open(&st->idx, ipath, rw) < 0)
+    goto fail;
+  if(st->data.size == 0){
+    /* New store */
+    if(!rw || dbase_store_grow(st, STORE_EXTENT) < 0)
+      goto fail;
+    memset(st->hdr, 0, sizeof(store_hdr));
+    memcpy(st->hdr->magic, STORE_MAGIC, 8);
+    st->hdr->order = STORE_ORDER;
+    st->hdr->rec_size = sizeof(spec_record);
+    st->hdr->channels = DBASE_LEN + 1;
+  }
+  else{
+    st->hdr = (store_hdr *) st->data.base;
+    if(st->data.size < STORE_HDR_SIZE || memcmp(st->hdr->magic, STORE_MAGIC, 8) != 0 ||
+       st->hdr->order != STORE_ORDER || st->hdr->rec_size != sizeof(spec_record) ||
+       st->hdr->channels != DBASE_LEN + 1){
+      fprintf(stderr, "E: libdbase_store_open(), %s is not a spectrum store of this host\n", path);
+      goto fail;
+    }
+    st->cap = (st->data.size - STORE_HDR_SIZE) / sizeof(spec_record);
+    n = st->hdr->count;
+    if(n > st->cap){
+      fprintf(stderr, "E: libdbase_store_open(), %s is truncated\n", path);
+      goto fail;
+    }
+    have = st->idx.size / sizeof(uint64_t);
+    if(have < n){
+      /* Index behind the records, rebuild it */
+      if(!rw){
+	fprintf(stderr, "E: libdbase_store_open(), index of %s is behind, open for writing\n", path);
+	goto fail;
+      }
+      fprintf(stderr, "W: libdbase_store_open(), rebuilding index of %s\n", path);
+    }
+    if(rw && dbase_store_grow(st, st->cap > n ? st->cap : n + STORE_EXTENT) < 0)
+      goto fail;
+    st->time = (uint64_t *) st->idx.base;
+    for(k = have; rw && k < n; k++)
+      st->time[k] = dbase_store_rec(st, k)->time;
+  }
+  free(ipath);
+  return st;
+ fail:
+  free(ipath);
+  dbase_map_close(&st->data);
+  dbase_map_close(&st->idx);
+  free(st);
+  return NULL;
+}
+
+int libdbase_store_close(spec_store *st){
+  if(st == NULL)
+    return -1;
+  int err = 0;
+  if(st->rw){
+    uint64_t n = st->hdr->count;
+    libdbase_store_sync(st);
+    munmap(st->data.base, st->data.size);
+    munmap(st->idx.base, st->idx.size);
+    st->data.base = st->idx.base = NULL;
+    if(ftruncate(st->data.fd, (off_t) (STORE_HDR_SIZE + n * sizeof(spec_record))) < 0 ||
+       ftruncate(st->idx.fd, (off_t) (n * sizeof(uint64_t))) < 0){
+      fprintf(stderr, "E: libdbase_store_close() unable to truncate, errno=%d\n", errno);
+      err = -errno;
+    }
+  }
+  dbase_map_close(&st->data);
+  dbase_map_close(&st->idx);
+  free(st);
+  return err;
+}
+
+int libdbase_store_append_spec(spec_store *st, uint64_t time, 
+			       const status_msg *status, const int32_t *spec){
+  if(st == NULL || spec == NULL || !st->rw){
+    fprintf(stderr, "E: libdbase_store_append_spec(), store not writable or spec was NULL\n");
+    return -1;
+  }
+  uint64_t n = st->hdr->count;
+  int err;
+  spec_record *r;
+  if(n == st->cap && (err = dbase_store_grow(st, st->cap + STORE_EXTENT)) < 0)
+    return err;
+  /* Keep times non-decreasing for the searches */
+  if(n > 0 && time < st->time[n - 1])
+    time = st->time[n - 1];
+  r = (spec_record *) (st->data.base + STORE_HDR_SIZE) + n;
+  r->time = time;
+  r->seq = n;
+  if(status != NULL)
+    memcpy(&r->status, status, sizeof(status_msg));
+  else
+    memset(&r->status, 0, sizeof(status_msg));
+  memcpy(r->spec, spec, sizeof(r->spec));
+  st->time[n] = time;
+  st->hdr->count = n + 1;
+  return 0;
+}
+
+int libdbase_store_append(spec_store *st, const detector *det){
+  if(det == NULL){
+    fprintf(stderr, "E: libdbase_store_append(), detector was NULL\n");
+    return -1;
+  }
+  return libdbase_store_append_spec(st, dbase_wall_time_us(), &det->status, det->spec);
+}
+
+int libdbase_store_sync(spec_store *st){
+  if(st == NULL || !st->rw)
+    return -1;
+  if(msync(st->data.base, st->data.size, MS_SYNC) < 0 ||
+     msync(st->idx.base, st->idx.size, MS_SYNC) < 0){
+    fprintf(stderr, "E: libdbase_store_sync(), errno=%d\n", errno);
+    return -errno;
+  }
+  return 0;
+}
+
+uint64_t libdbase_store_count(const spec_store *st){
+  return st == NULL ? 0 : dbase_store_n(st);
+}
+
+const spec_record *libdbase_store_get(const spec_store *st, uint64_t idx){
+  if(st == NULL || idx >= dbase_store_n(st))
+    return NULL;
+  return dbase_store_rec(st, idx);
+}
+
+/* Number of records with time < t (or <= t if le) */
+static uint64_t dbase_store_bound(const spec_store *st, uint64_t t, int le){
+  uint64_t lo = 0, hi = dbase_store_n(st), mid;
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if(st->time[mid] < t || (le && st->time[mid] == t))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int64_t libdbase_store_find(const spec_store *st, uint64_t time){
+  if(st == NULL)
+    return -1;
+  return (int64_t) dbase_store_bound(st, time, 1) - 1;
+}
+
+uint64_t libdbase_store_range(const spec_store *st, uint64_t t0, uint64_t t1, uint64_t *first){
+  if(st == NULL || t1 <= t0){
+    if(first != NULL)
+      *first = 0;
+    return 0;
+  }
+  uint64_t a = dbase_store_bound(st, t0, 0), b = dbase_store_bound(st, t1, 0);
+  if(first != NULL)
+    *first = a;
+  return b - a;
+}
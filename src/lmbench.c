@@ -0,0 +1,217 @@
+/*
+ * lmbench.c: decoder and output benchmarks for libdbaserh
+ *
+ * Decodes synthetic list mode words (libdbase_lm_gen_words())
+ * in count-only and full-decode mode and reports events/s and
+ * ns/event. Also compares ASCII spectrum formatting with the
+ * old snprintf() loop and times energy rebinning. No device 
+ * is needed.
+ *
+ * usage: lmbench [events (M)]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>   /* printf(), ... */
+#include <stdlib.h>  /* malloc(), atof() */
+#include <string.h>  /* memcmp() */
+#include <time.h>    /* clock_gettime() */
+
+#include "libdbaserh.h"
+
+/* Readouts of a full FIFO, generated once and decoded 'rounds' times */
+#define BENCH_READS  64
+/* Spectra formatted per spectrum benchmark */
+#define BENCH_SPECTRA 20000
+
+/* Time in ns */
+static double now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+  Benchmark one configuration, prints one line per mode
+*/
+static int bench(const char *name, const lm_gen_cfg *cfg, double events){
+  int k, r, n[BENCH_READS], ev, total = 0, rounds;
+  uint32_t time = 0;
+  long long sum = 0;
+  double t0, t1;
+  uint32_t *words = (uint32_t *) malloc((size_t) BENCH_READS * LM_FIFO_WORDS * sizeof(uint32_t));
+  pulse *buf = (pulse *) malloc(LM_FIFO_WORDS * sizeof(pulse));
+  lm_gen *g = libdbase_lm_gen_new(cfg);
+  if(words == NULL || buf == NULL || g == NULL){
+    fprintf(stderr, "E: lmbench, out of memory\n");
+    libdbase_lm_gen_free(g);
+    free(buf);
+    free(words);
+    return -1;
+  }
+  for(k = 0; k < BENCH_READS; k++){
+    n[k] = libdbase_lm_gen_words(g, words + (size_t) k * LM_FIFO_WORDS, 
+				 LM_FIFO_WORDS, 0, &ev);
+    total += ev;
+  }
+  rounds = (int) (events / total) + 1;
+
+  /* Count only */
+  t0 = now_ns();
+  for(r = 0; r < rounds; r++)
+    for(k = 0; k < BENCH_READS; k++)
+      sum += libdbase_decode_lm_words(words + (size_t) k * LM_FIFO_WORDS, n[k], NULL, NULL);
+  t1 = now_ns();
+  printf("%-10s count   %12.0f events/s %8.3f ns/event\n", name,
+	 sum / (t1 - t0) * 1e9, (t1 - t0) / sum);
+
+  /* Full decode */
+  sum = 0;
+  t0 = now_ns();
+  for(r = 0; r < rounds; r++)
+    for(k = 0; k < BENCH_READS; k++){
+      ev = libdbase_decode_lm_words(words + (size_t) k * LM_FIFO_WORDS, n[k], buf, &time);
+      sum += ev;
+      /* Keep the stores alive */
+      time += buf[ev > 0 ? ev - 1 : 0].amp & 1;
+    }
+  t1 = now_ns();
+  printf("%-10s decode  %12.0f events/s %8.3f ns/event\n", name,
+	 sum / (t1 - t0) * 1e9, (t1 - t0) / sum);
+
+  libdbase_lm_gen_free(g);
+  free(buf);
+  free(words);
+  return 0;
+}
+
+/*
+  Spectrum formatting as dbase_print_spectrum_file() did it
+  before: snprintf() per channel into a 2 KiB buffer, written
+  out whenever it is nearly full
+*/
+static int format_snprintf(const int32_t *spec, int len, char *out){
+  int k, left, w = 0, o = 0;
+  const int n = 2048;
+  char buf[2048];
+  for(k = 0; k < len; k++) {
+    left = n - w;
+    w += snprintf(buf+w, left, "%d ", spec[k]);
+    if( left < 10 ) {
+      memcpy(out + o, buf, w);
+      o += w;
+      w = 0;
+    }
+  }
+  memcpy(out + o, buf, w);
+  o += w;
+  out[o++] = '\n';
+  return o;
+}
+
+/*
+  ASCII spectra: counts from a few to ~10^6 per channel
+*/
+static int bench_spectrum(void){
+  int32_t spec[DBASE_LEN + 1];
+  static char a[12 * (DBASE_LEN + 1) + 1], b[12 * (DBASE_LEN + 1) + 1];
+  int k, na = 0, nb = 0;
+  double t0, t1, t2;
+  long long bytes = 0;
+  for(k = 0; k <= DBASE_LEN; k++)
+    spec[k] = (int32_t) ((k * 2654435761u) % 1000000u) >> (k % 16);
+
+  t0 = now_ns();
+  for(k = 0; k < BENCH_SPECTRA; k++){
+    spec[k % (DBASE_LEN + 1)]++;
+    na = format_snprintf(spec, DBASE_LEN + 1, a);
+    bytes += na;
+  }
+  t1 = now_ns();
+  for(k = 0; k < BENCH_SPECTRA; k++){
+    spec[k % (DBASE_LEN + 1)]--;
+    nb = libdbase_format_spectrum(spec, DBASE_LEN + 1, b, sizeof(b));
+    bytes += nb;
+  }
+  t2 = now_ns();
+  /* Same output? (the spectrum is back where it started) */
+  na = format_snprintf(spec, DBASE_LEN + 1, a);
+  if(na != nb || memcmp(a, b, na) != 0){
+    fprintf(stderr, "E: lmbench, spectrum formats differ\n");
+    return -1;
+  }
+  printf("spectrum   snprintf %10.1f us/spectrum %8.2f ns/channel\n",
+	 (t1 - t0) / BENCH_SPECTRA / 1e3, (t1 - t0) / BENCH_SPECTRA / (DBASE_LEN + 1));
+  printf("spectrum   format   %10.1f us/spectrum %8.2f ns/channel\n",
+	 (t2 - t1) / BENCH_SPECTRA / 1e3, (t2 - t1) / BENCH_SPECTRA / (DBASE_LEN + 1));
+  return bytes > 0 ? 0 : -1;
+}
+
+/*
+  Energy rebinning: two gain-mismatched detectors summed on a
+  common 1024 bin grid
+*/
+static int bench_rebin(void){
+  int32_t spec[DBASE_LEN + 1];
+  static double out[DBASE_LEN + 1];
+  const double c1[] = {0.0, 3.0}, c2[] = {5.0, 3.2, -2e-5};
+  spec_calib *a = libdbase_calib_new(c1, 2, 0.0, 3000.0, DBASE_LEN + 1);
+  spec_calib *b = libdbase_calib_new(c2, 3, 0.0, 3000.0, DBASE_LEN + 1);
+  int k;
+  double t0, t1;
+  if(a == NULL || b == NULL){
+    libdbase_calib_free(a);
+    libdbase_calib_free(b);
+    return -1;
+  }
+  for(k = 0; k <= DBASE_LEN; k++)
+    spec[k] = (int32_t) ((k * 2654435761u) % 1000000u) >> (k % 16);
+  t0 = now_ns();
+  for(k = 0; k < BENCH_SPECTRA; k++){
+    libdbase_calib_rebin(a, spec, out);
+    libdbase_calib_rebin_add(b, spec, out);
+  }
+  t1 = now_ns();
+  printf("rebin      2 dets   %10.1f us/readout  %8.2f ns/channel\n",
+	 (t1 - t0) / BENCH_SPECTRA / 1e3, (t1 - t0) / BENCH_SPECTRA / (2 * (DBASE_LEN + 1)));
+  libdbase_calib_free(a);
+  libdbase_calib_free(b);
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+  double events = 1e6 * (argc > 1 ? atof(argv[1]) : 200.0);
+  lm_gen_cfg cfg;
+
+  /* Moderate rate, few time words per event */
+  libdbase_lm_gen_defaults(&cfg);
+  bench("10kcps", &cfg, events);
+
+  /* Low rate, many time words */
+  cfg.rate = 100.0;
+  bench("100cps", &cfg, events);
+
+  /* High rate and bursty */
+  libdbase_lm_gen_defaults(&cfg);
+  cfg.rate = 100000.0;
+  cfg.burst = 0.1;
+  bench("bursty", &cfg, events);
+
+  /* ASCII spectrum output */
+  bench_spectrum();
+
+  /* Energy rebinning */
+  bench_rebin();
+
+  return 0;
+}